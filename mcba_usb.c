@@ -18,31 +18,112 @@
  */
 
 #include <linux/signal.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
+#include <linux/clocksource.h>
+#include <linux/timecounter.h>
+#include <linux/uaccess.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/pkt_sched.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/average.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/fault-inject.h>
 #include <linux/usb.h>
+#include <asm/unaligned.h>
 
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
 
+#define CREATE_TRACE_POINTS
+#include "mcba_usb_trace.h"
+#include "mcba_usb_capture.h"
+#include "mcba_usb_proto.h"
+
 /* vendor and product id */
 #define MCBA_MODULE_NAME         "mcba_usb"
 #define MCBA_VENDOR_ID           0x04d8
 #define MCBA_PRODUCT_ID          0x0a30
 
-/* driver constants */
-#define MCBA_MAX_RX_URBS         20
-#define MCBA_MAX_TX_URBS         20
-#define MCBA_CTX_FREE            MCBA_MAX_TX_URBS
+/* driver constants, URB counts are tunable with ethtool -G up to the max */
+#define MCBA_MAX_RX_URBS         64
+#define MCBA_MAX_TX_URBS         32
+#define MCBA_DEF_RX_URBS         20
+#define MCBA_DEF_TX_URBS         20
 
 /* RX buffer must be bigger than msg size since at the
- * beggining USB messages are stacked.
+ * beggining USB messages are stacked. Larger buffers (rx_buf_size module
+ * parameter) are kept a multiple of the bulk packet size.
  */
 #define MCBA_USB_RX_BUFF_SIZE    64
+#define MCBA_USB_RX_BUFF_MAX     512
 #define MCBA_USB_TX_BUFF_SIZE    (sizeof(struct mcba_usb_msg))
 
+/* TX messages stacked into one bulk OUT transfer (must fit RX buffer size) */
+#define MCBA_TX_BATCH_MAX        3
+#define MCBA_USB_TX_BATCH_SIZE   (MCBA_TX_BATCH_MAX * MCBA_USB_TX_BUFF_SIZE)
+
+/* PIC_USB firmware version that accepts stacked TX messages. Official v2.3
+ * firmware parses one message per transfer.
+ */
+#define MCBA_FW_VER(major, minor)    (((major) << 8) | (minor))
+#define MCBA_TX_BATCH_MIN_FW_VER     MCBA_FW_VER(2, 4)
+
+/* Stopped TX queue is woken once a quarter of the contexts is free again */
+#define MCBA_TX_WAKE_THRESH(priv)    DIV_ROUND_UP((priv)->tx_bulk_size, 4)
+
+/* With tx_prio_slots, urgent frames get their own TX queue and contexts */
+#define MCBA_TXQ_BULK            0
+#define MCBA_TXQ_PRIO            1
+#define MCBA_TX_QUEUES           2
+
+/* Control commands are sent from their own URB, and wait that long for it */
+#define MCBA_CMD_TIMEOUT         (HZ / 2)
+
+/* RX URBs which could not be resubmitted are tried again after that long */
+#define MCBA_RX_RETRY            (HZ / 10)
+
+/* With adaptive-rx, RX URBs are parked down to MCBA_RX_IDLE_URBS once no CAN
+ * frame or TX echo was seen for MCBA_RX_IDLE. Keep alives don't count.
+ */
+#define MCBA_RX_IDLE             (HZ / 10)
+#define MCBA_RX_IDLE_URBS        2
+
+/* ethtool -C defaults and limits */
+#define MCBA_RX_USECS_DEF        0
+#define MCBA_RX_USECS_LOW_DEF    1000
+#define MCBA_RX_USECS_MAX        100000
+#define MCBA_RX_FRAMES_DEF       1
+
+/* reads of the keep alive replies to the version query after probe */
+#define MCBA_INFO_READS          10
+#define MCBA_INFO_TIMEOUT_MS     50
+
+/* entries in the driver side RX acceptance filter */
+#define MCBA_MAX_RX_FILTERS      16
+
+/* capture ring size in records, see capture_records */
+#define MCBA_CAP_MIN_RECORDS     1024
+#define MCBA_CAP_MAX_RECORDS     (1 << 22)
+
+/* log2 latency histogram buckets, bucket n counts [2^(n-1), 2^n) us */
+#define MCBA_LAT_BUCKETS         32
+
 /* MCBA endpoint numbers */
 #define MCBA_USB_EP_IN           1
 #define MCBA_USB_EP_OUT          1
@@ -52,16 +133,18 @@
  */
 #define MCBA_CAN_CLOCK           40000000
 
-/* Microchip command id */
-#define MBCA_CMD_RECEIVE_MESSAGE                0xE3
-#define MBCA_CMD_I_AM_ALIVE_FROM_CAN            0xF5
-#define MBCA_CMD_I_AM_ALIVE_FROM_USB            0xF7
-#define MBCA_CMD_CHANGE_BIT_RATE                0xA1
-#define MBCA_CMD_TRANSMIT_MESSAGE_EV            0xA3
-#define MBCA_CMD_SETUP_TERMINATION_RESISTANCE   0xA8
-#define MBCA_CMD_READ_FW_VERSION                0xA9
-#define MBCA_CMD_NOTHING_TO_SEND                0xFF
-#define MBCA_CMD_TRANSMIT_MESSAGE_RSP           0xE2
+/* RX message timestamp is a free running 32-bit microsecond counter. It is
+ * re-anchored to host time whenever the bus was idle long enough for a wrap
+ * to go unnoticed. In between, the device clock is steered towards host time
+ * once per MCBA_TS_ADJ_NS: by a phase step of at most MCBA_TS_MAX_STEP_NS
+ * and a frequency correction of at most MCBA_TS_MAX_PPB.
+ */
+#define MCBA_TS_FREQ             1000000
+#define MCBA_TS_RESYNC_NS \
+	((u64)NSEC_PER_SEC * BIT_ULL(31) / MCBA_TS_FREQ)
+#define MCBA_TS_ADJ_NS           NSEC_PER_SEC
+#define MCBA_TS_MAX_STEP_NS      (100 * NSEC_PER_USEC)
+#define MCBA_TS_MAX_PPB          500000
 
 /* debug module parameter handling */
 #define MCBA_PARAM_DEBUG_DISABLE    0
@@ -70,160 +153,299 @@
 #define MCBA_IS_USB_DEBUG()         (debug & MCBA_PARAM_DEBUG_USB)
 #define MCBA_IS_CAN_DEBUG()         (debug & MCBA_PARAM_DEBUG_CAN)
 
-#define MCBA_VER_REQ_USB             1
-#define MCBA_VER_REQ_CAN             2
-
-#define MCBA_CAN_S_SID0_SID2_MASK    0x7
-#define MCBA_CAN_S_SID3_SID10_MASK   0x7F8
-#define MCBA_CAN_S_SID3_SID10_SHIFT  3
-
-#define MCBA_CAN_EID0_EID7_MASK      0xff
-#define MCBA_CAN_EID8_EID15_MASK     0xff00
-#define MCBA_CAN_EID16_EID17_MASK    0x30000
-#define MCBA_CAN_E_SID0_SID2_MASK    0x1c0000
-#define MCBA_CAN_E_SID3_SID10_MASK   0x1fe00000
-#define MCBA_CAN_EID8_EID15_SHIFT    8
-#define MCBA_CAN_EID16_EID17_SHIFT   16
-#define MCBA_CAN_E_SID0_SID2_SHIFT   18
-#define MCBA_CAN_E_SID3_SID10_SHIFT  21
-
-#define MCBA_SIDL_SID0_SID2_MASK     0xe0
-#define MCBA_SIDL_EXID_MASK          0x8
-#define MCBA_SIDL_EID16_EID17_MASK   0x3
-#define MCBA_SIDL_SID0_SID2_SHIFT    5
-
-#define MCBA_DLC_MASK                0xf
-#define MCBA_DLC_RTR_MASK            0x40
-
-#define MCBA_CAN_RTR_MASK            0x40000000
-#define MCBA_CAN_EXID_MASK           0x80000000
-
-#define MCBA_SET_S_SIDL(can_id)\
-(((can_id) & MCBA_CAN_S_SID0_SID2_MASK) << MCBA_SIDL_SID0_SID2_SHIFT)
-
-#define MCBA_SET_E_SIDL(can_id)\
-(((((can_id) & MCBA_CAN_E_SID0_SID2_MASK) >> MCBA_CAN_E_SID0_SID2_SHIFT)\
-<< MCBA_SIDL_SID0_SID2_SHIFT) |\
-(((can_id) & MCBA_CAN_EID16_EID17_MASK) >> MCBA_CAN_EID16_EID17_SHIFT) |\
-MCBA_SIDL_EXID_MASK)
-
-#define MCBA_SET_S_SIDH(can_id)\
-(((can_id) & MCBA_CAN_S_SID3_SID10_MASK) >> MCBA_CAN_S_SID3_SID10_SHIFT)
-
-#define MCBA_SET_E_SIDH(can_id)\
-(((can_id) & MCBA_CAN_E_SID3_SID10_MASK) >> MCBA_CAN_E_SID3_SID10_SHIFT)
-
-#define MCBA_SET_EIDL(can_id)\
-((can_id) & MCBA_CAN_EID0_EID7_MASK)
-
-#define MCBA_SET_EIDH(can_id)\
-(((can_id) & MCBA_CAN_EID8_EID15_MASK) >> MCBA_CAN_EID8_EID15_SHIFT)
-
-#define MCBA_CAN_GET_SID(usb_msg)\
-((((usb_msg)->sidl & MCBA_SIDL_SID0_SID2_MASK) >> MCBA_SIDL_SID0_SID2_SHIFT) |\
-((usb_msg)->sidh << MCBA_CAN_S_SID3_SID10_SHIFT))
-
-#define MCBA_CAN_GET_EID(usb_msg)\
-((((usb_msg)->sidh << MCBA_CAN_E_SID3_SID10_SHIFT) |\
-(((usb_msg)->sidl & MCBA_SIDL_SID0_SID2_MASK) >> MCBA_SIDL_SID0_SID2_SHIFT) \
-<< MCBA_CAN_E_SID0_SID2_SHIFT) |\
-(((usb_msg)->sidl & MCBA_SIDL_EID16_EID17_MASK) \
-<< MCBA_CAN_EID16_EID17_SHIFT) |\
-((usb_msg)->eidh << MCBA_CAN_EID8_EID15_SHIFT) |\
-(usb_msg)->eidl |\
-MCBA_CAN_EXID_MASK)
-
-#define MCBA_RX_IS_EXID(usb_msg)    ((usb_msg)->sidl & MCBA_SIDL_EXID_MASK)
-#define MCBA_RX_IS_RTR(usb_msg)     ((usb_msg)->dlc & MCBA_DLC_RTR_MASK)
-#define MCBA_TX_IS_EXID(can_frame)  ((can_frame)->can_id & MCBA_CAN_EXID_MASK)
-#define MCBA_TX_IS_RTR(can_frame)   ((can_frame)->can_id & MCBA_CAN_RTR_MASK)
+/* CAN frame bits on the wire without data. SOF up to CRC are stuffed,
+ * CRC delimiter, ACK, EOF and intermission are not.
+ */
+#define MCBA_CAN_SFF_STUFFED_BITS    34
+#define MCBA_CAN_EFF_STUFFED_BITS    54
+#define MCBA_CAN_TAIL_BITS           13
+
+/* PIC_CAN reports the MCP2515 error flag register (EFLG) as can_stat */
+#define MCBA_EFLG_EWARN              0x01
+#define MCBA_EFLG_RXWAR              0x02
+#define MCBA_EFLG_TXWAR              0x04
+#define MCBA_EFLG_RXEP               0x08
+#define MCBA_EFLG_TXEP               0x10
+#define MCBA_EFLG_TXBO               0x20
+#define MCBA_EFLG_RX0OVR             0x40
+#define MCBA_EFLG_RX1OVR             0x80
+#define MCBA_EFLG_RXOVR              (MCBA_EFLG_RX0OVR | MCBA_EFLG_RX1OVR)
+
+/* Packet and byte counters of one direction, per CPU. Errors and drops
+ * are rare and stay in netdev->stats.
+ */
+struct mcba_usb_pcpu_stats {
+	u64 packets;
+	u64 bytes;
+	struct u64_stats_sync syncp;
+};
 
-struct mcba_usb_ctx {
+/* Driver and firmware counters reported by ethtool -S. Like the error
+ * counters in netdev->stats they are plain counters. They are split by the
+ * side writing them, so each set stays with the members of its side in
+ * mcba_priv.
+ */
+struct mcba_usb_rx_xstats {
+	unsigned long fw_rx_buff_ovfl;	/* accumulated from keep alive */
+	unsigned long fw_rx_lost;	/* accumulated from keep alive */
+	unsigned long fw_tx_bus_off;	/* last reported value */
+	unsigned long fw_can_stat;	/* last reported value */
+	unsigned long rx_resubmit_err;
+	unsigned long rx_urb_parked;
+	unsigned long rx_urb_unparked;
+	unsigned long rx_format_err;
+	unsigned long rx_alloc_err;
+	unsigned long rx_filtered;
+	unsigned long rx_csum_err;
+	unsigned long urb_alloc_err; /* ifup only */
+};
+
+/* xmit, TX URB completion and the command channel */
+struct mcba_usb_tx_xstats {
+	unsigned long tx_busy;
+	unsigned long tx_submit_err;
+	unsigned long lb_filtered; /* rx_filtered of looped back frames */
+	unsigned long lb_alloc_err; /* rx_alloc_err of looped back frames */
+	unsigned long cmd_coalesced;
+	unsigned long cmd_err;
+};
+
+/* bus load in permille, averaged over roughly the last 8 seconds */
+DECLARE_EWMA(busload, 4, 8)
+
+/* Frames and wire bits of one direction, kept with the other hot members
+ * of that direction
+ */
+struct mcba_usb_load_cnt {
+	atomic_long_t frames;
+	atomic_long_t bits;
+};
+
+/* Both directions folded into per second rates by mcba_usb_load_timer()
+ * while the interface is up
+ */
+struct mcba_usb_load {
+	struct timer_list timer;
+
+	/* timer only */
+	unsigned long last_frames;
+	unsigned long last_bits;
+	unsigned long last_jiffies;
+
+	/* written by the timer, read from sysfs */
+	unsigned long fps;
+	unsigned long bps;
+	unsigned long peak_fps;
+	unsigned long peak_bps;
+	unsigned long permille;
+	struct ewma_busload avg;
+};
+
+/* Plain counters like xstats, reset by writing to the debugfs file */
+struct mcba_usb_lat_hist {
+	unsigned long cnt[MCBA_LAT_BUCKETS];
+};
+
+/* RX URB and the time it completed, for the RX latency histogram */
+struct mcba_usb_rx_urb {
 	struct mcba_priv *priv;
-	u32 ndx;
+	struct urb *urb;
+	u64 done_ns;
+};
+
+/* RX acceptance filter, a frame is accepted if it matches any entry */
+struct mcba_usb_rx_filter {
+	struct rcu_head rcu;
+	unsigned int cnt;
+	struct can_filter f[];
+};
+
+/* Raw RX capture ring behind debugfs "capture", allocated when the file is
+ * opened. The NAPI poll is the only producer, head is its private copy of
+ * hdr->head and published once per poll.
+ */
+struct mcba_usb_cap {
+	struct mcba_priv *priv; /* NULL once the device is gone, mcba_cap_lock */
+	void *mem; /* vmalloc_user(), header page followed by the records */
+	size_t size;
+	struct mcba_cap_hdr *hdr;
+	struct mcba_cap_rec *rec;
+	u32 mask;
+	u64 head;
+	wait_queue_head_t wait;
+};
+
+/* One slot per control command, the lowest pending slot is sent first */
+enum mcba_usb_cmd_slot {
+	MCBA_CMD_SLOT_BITRATE,
+	MCBA_CMD_SLOT_TERMINATION,
+	MCBA_CMD_SLOT_FW_VER_USB,
+	MCBA_CMD_SLOT_FW_VER_CAN,
+	MCBA_CMD_SLOTS
+};
+
+/* Control commands bypass the data path with a single URB allocated for the
+ * lifetime of the device. A command queued while its slot is still pending
+ * replaces the pending one. Tickets count commands queued resp. completed
+ * per slot, so waiters of a replaced command are woken by its successor.
+ */
+struct mcba_usb_cmd_chan {
+	spinlock_t lock;
+	struct urb *urb;
+	u8 *buf;
+	bool alive; /* cleared when the device goes away */
+	bool suspended; /* pending commands wait for resume */
+	int busy; /* slot owning the URB, -1 if idle */
+	unsigned int busy_ticket;
+	unsigned long pending; /* slots waiting for the URB */
+	u8 msg[MCBA_CMD_SLOTS][MCBA_USB_MSG_SIZE];
+	unsigned int queued[MCBA_CMD_SLOTS];
+	unsigned int done[MCBA_CMD_SLOTS];
+	int status[MCBA_CMD_SLOTS];
+	wait_queue_head_t wait;
+};
+
+/* TX slot, tx_context[ndx] of its mcba_priv */
+struct mcba_usb_ctx {
+	struct urb *urb;
+	u8 *buf;
+	u64 xmit_ns; /* lat_hist only */
+	atomic_t refs; /* TX URB and/or pending TRANSMIT_MESSAGE_RSP */
+	unsigned int rsp_seq; /* order of the frame in rsp_fifo, rsp_lock */
+	u8 ndx;
 	u8 dlc;
-	bool can;
+	u8 len; /* wire bytes accounted to BQL */
+	u8 txq;
+	u8 bits; /* on the wire, see mcba_usb_msg_bits() */
+	bool rsp; /* echo released by TRANSMIT_MESSAGE_RSP */
+
+	/* messages carried by this ctx's URB, including its own */
+	u8 batch_cnt;
+	u8 batch_ndx[MCBA_TX_BATCH_MAX];
 };
 
-/* Structure to hold all of our device specific stuff */
+/* Structure to hold all of our device specific stuff.
+ *
+ * Members are grouped by the side that writes them: set up once or rarely
+ * written, RX (URB completion and mcba_usb_poll()) and TX (xmit and URB
+ * completion). RX and TX each start on their own cache line, so the RX and
+ * TX completion CPUs do not bounce lines between them. Check new members
+ * with pahole -C mcba_priv mcba_usb.ko.
+ */
 struct mcba_priv {
 	struct can_priv can; /* must be the first member */
-	struct sk_buff *echo_skb[MCBA_MAX_TX_URBS];
-	struct mcba_usb_ctx tx_context[MCBA_MAX_TX_URBS];
 
 	struct usb_device *udev;
+	struct usb_interface *intf;
 	struct net_device *netdev;
-	struct usb_anchor tx_submitted;
+	int rx_cpu; /* CPU running NAPI, -1 for the completing CPU */
+
+	/* ring sizes, changed only while the interface is down */
+	unsigned int rx_ring_size;
+	unsigned int tx_ring_size;
+	unsigned int tx_prio_slots;
+	unsigned int rx_buf_size;
+	unsigned int rx_msg_max; /* messages completed by one RX transfer */
+
+	bool echo_rsp;
+	bool tx_disable; /* changed only while the interface is down */
+	unsigned long ts_resync; /* bit 0, set outside poll to re-anchor */
+	u16 bitrate_kbps;
+	struct hwtstamp_config hwts_cfg;
+	struct mcba_usb_load load;
+	struct mcba_usb_cmd_chan cmd;
+	struct work_struct info_work; /* version query after probe */
+	struct dentry *debugfs;
+
+	/* RX */
+	struct napi_struct napi ____cacheline_aligned_in_smp;
 	struct usb_anchor rx_submitted;
+	struct usb_anchor rx_done; /* completed, waiting for mcba_usb_poll() */
+	struct usb_anchor rx_failed; /* failed to resubmit, see rx_retry */
+	struct timer_list rx_retry; /* kicks NAPI to resubmit rx_failed */
+	struct usb_anchor rx_parked; /* held back while idle, adaptive-rx */
+	int rx_parked_cnt; /* only touched from poll and with NAPI disabled */
+	unsigned long rx_busy; /* jiffies of the last CAN frame or TX echo */
+
+	/* completion coalescing, see mcba_usb_rx_coalesce() */
+	struct hrtimer rx_coal_timer;
+	atomic_t rx_coal_cnt; /* completions since the last poll */
+	unsigned int rx_usecs;
+	unsigned int rx_usecs_low; /* while idle, with rx_adaptive */
+	unsigned int rx_frames;
+	bool rx_adaptive;
+	struct work_struct rx_work; /* schedules NAPI on rx_cpu */
+	struct mcba_usb_pcpu_stats __percpu *rx_stats;
+	struct mcba_usb_load_cnt rx_load;
+	u64 rx_done_ns; /* completion time of the URB being parsed */
+
+	/* record split across RX transfers, only touched from poll */
+	struct mcba_usb_rx_parser rx_parser;
+
+	/* hardware timestamps, only touched from mcba_usb_poll() */
+	struct cyclecounter cc;
+	struct timecounter tc;
+	u64 ts_host_ns;
+	u64 ts_adj_ns; /* host time the current steering window began */
+	s64 ts_min_off; /* smallest host minus device time in the window */
+	s32 ts_ppb; /* frequency correction applied to ts_mult */
+	u32 ts_mult; /* nominal cc.mult */
+	u32 ts_raw;
+	bool ts_valid;
+
+	/* NULL accepts everything, replaced under RTNL from sysfs */
+	struct mcba_usb_rx_filter __rcu *rx_filter;
+
+	/* set while debugfs "capture" is open, under mcba_cap_lock */
+	struct mcba_usb_cap __rcu *cap;
+
+	/* last keep alive counters, deltas go to netdev stats */
 	struct can_berr_counter bec;
+	bool ka_can_valid;
+	u8 ka_rx_buff_ovfl;
+	u16 ka_rx_lost;
+	u8 ka_can_stat;
 	u8 termination_state;
 	bool usb_ka_first_pass;
 	bool can_ka_first_pass;
-};
-
-/* command frame */
-struct __packed mcba_usb_msg_can {
-	u8 cmd_id;
-	u8 eidh;
-	u8 eidl;
-	u8 sidh;
-	u8 sidl;
-	u8 dlc;
-	u8 data[8];
-	u8 timestamp[4];
-	u8 checksum;
-};
-
-/* command frame */
-struct __packed mcba_usb_msg {
-	u8 cmd_id;
-	u8 unused[18];
-};
-
-struct __packed mcba_usb_msg_ka_usb {
-	u8 cmd_id;
-	u8 termination_state;
-	u8 soft_ver_major;
-	u8 soft_ver_minor;
-	u8 unused[15];
-};
 
-struct __packed mcba_usb_msg_ka_can {
-	u8 cmd_id;
-	u8 tx_err_cnt;
-	u8 rx_err_cnt;
-	u8 rx_buff_ovfl;
-	u8 tx_bus_off;
-	u8 can_bitrate_hi;
-	u8 can_bitrate_lo;
-	u8 rx_lost_lo;
-	u8 rx_lost_hi;
-	u8 can_stat;
-	u8 soft_ver_major;
-	u8 soft_ver_minor;
-	u8 debug_mode;
-	u8 test_complete;
-	u8 test_result;
-	u8 unused[4];
-};
+	/* MCBA_FW_VER() of the PICs, 0 until a keep alive told us */
+	u16 fw_ver_usb;
+	u16 fw_ver_can;
 
-struct __packed mcba_usb_msg_change_bitrate {
-	u8 cmd_id;
-	u8 bitrate_hi;
-	u8 bitrate_lo;
-	u8 unused[16];
-};
+	/* rx_filtered may count every frame */
+	struct mcba_usb_rx_xstats rx_xstats;
 
-struct __packed mcba_usb_msg_terminaton {
-	u8 cmd_id;
-	u8 termination;
-	u8 unused[17];
-};
+	/* RX URB completion to netif delivery */
+	struct mcba_usb_lat_hist rx_lat;
+	int rx_urbs_cnt;
+	struct mcba_usb_rx_urb rx_urbs[MCBA_MAX_RX_URBS];
 
-struct __packed mcba_usb_msg_fw_ver {
-	u8 cmd_id;
-	u8 pic;
-	u8 unused[17];
+	/* TX */
+	DECLARE_BITMAP(tx_ctx_map, MCBA_MAX_TX_URBS) /* set bit = ctx in use */
+		____cacheline_aligned_in_smp;
+	struct usb_anchor tx_submitted;
+	struct mcba_usb_pcpu_stats __percpu *tx_stats;
+	struct mcba_usb_load_cnt tx_load;
+	unsigned int tx_bulk_size; /* contexts below are shared by all queues */
+	u16 tx_prio_id; /* base IDs below it go to MCBA_TXQ_PRIO */
+	bool tx_batch_ok; /* see mcba_usb_update_tx_batch() */
+	struct mcba_usb_tx_xstats tx_xstats;
+	/* per TX queue, serialized by the queue's xmit lock */
+	struct mcba_usb_ctx *tx_batch_ctx[MCBA_TX_QUEUES];
+
+	/* ctx indexes of frames waiting for TRANSMIT_MESSAGE_RSP, in the
+	 * order they were handed to the device
+	 */
+	spinlock_t rsp_lock;
+	u8 rsp_fifo[MCBA_MAX_TX_URBS];
+	unsigned int rsp_head;
+	unsigned int rsp_tail;
+	unsigned int rsp_seq; /* next frame sequence number, never rewound */
+
+	/* xmit to TX URB completion */
+	struct mcba_usb_lat_hist tx_lat;
+	struct mcba_usb_ctx tx_context[MCBA_MAX_TX_URBS];
 };
 
 struct bitrate_settings {
@@ -244,7 +466,12 @@ static const struct can_bittiming_const mcba_bittiming_const = {
 	.brp_inc = 2,
 };
 
-/* predefined values hardcoded in device's firmware */
+/* Largest error accepted between a requested bitrate and the nearest
+ * firmware setting, in permille (as CAN_CALC_MAX_ERROR in can-dev)
+ */
+#define MCBA_BITRATE_MAX_ERROR   50
+
+/* predefined values hardcoded in device's firmware, sorted by bitrate */
 static const struct bitrate_settings br_settings[] = {
 	{
 		.bt = {
@@ -483,6 +710,55 @@ static const struct bitrate_settings br_settings[] = {
 	}
 };
 
+/* Nearest firmware setting to bitrate, NULL if none within tolerance */
+static const struct bitrate_settings *mcba_usb_find_bitrate(u32 bitrate)
+{
+	const struct bitrate_settings *best;
+	unsigned int lo = 0;
+	unsigned int hi = ARRAY_SIZE(br_settings);
+	u32 diff;
+
+	/* first setting not below bitrate */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (br_settings[mid].bt.bitrate < bitrate)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ARRAY_SIZE(br_settings) ||
+	    (lo && bitrate - br_settings[lo - 1].bt.bitrate <
+		   br_settings[lo].bt.bitrate - bitrate))
+		lo--;
+
+	best = &br_settings[lo];
+	diff = best->bt.bitrate > bitrate ? best->bt.bitrate - bitrate :
+					     bitrate - best->bt.bitrate;
+
+	if ((u64)diff * 1000 > (u64)bitrate * MCBA_BITRATE_MAX_ERROR)
+		return NULL;
+
+	return best;
+}
+
+/* Take over a firmware setting as the interface bittiming, RTNL held */
+static void mcba_usb_apply_bitrate(struct mcba_priv *priv,
+				   const struct bitrate_settings *settings)
+{
+	struct can_bittiming *bt = &priv->can.bittiming;
+
+	memcpy(bt, &settings->bt, sizeof(struct can_bittiming));
+
+	/* recalculate bitrate as it may be different than default */
+	bt->bitrate = 1000000000 / ((bt->sjw + bt->prop_seg +
+				    bt->phase_seg1 + bt->phase_seg2) *
+				    bt->tq);
+
+	priv->bitrate_kbps = settings->kbps;
+}
+
 static int debug;
 module_param(debug, int, 0664);
 MODULE_PARM_DESC(debug,
@@ -490,6 +766,105 @@ MODULE_PARM_DESC(debug,
 		 __stringify(MCBA_PARAM_DEBUG_USB) "='PIC_USB debugs enabled' "
 		 __stringify(MCBA_PARAM_DEBUG_CAN) "='PIC_CAN debugs enabled'");
 
+static bool tx_batch;
+module_param(tx_batch, bool, 0444);
+MODULE_PARM_DESC(tx_batch,
+		 "Stack up to " __stringify(MCBA_TX_BATCH_MAX)
+		 " CAN frames per USB transfer (requires PIC_USB firmware >= 2.4)");
+
+static bool echo_rsp;
+module_param(echo_rsp, bool, 0444);
+MODULE_PARM_DESC(echo_rsp,
+		 "Release TX echo and count tx_packets on the device's transmission response instead of USB completion (enables TX hardware timestamps)");
+
+static bool lat_hist;
+module_param(lat_hist, bool, 0644);
+MODULE_PARM_DESC(lat_hist,
+		 "Collect RX/TX latency histograms (debugfs mcba_usb/<usb interface>/)");
+
+static bool rx_csum;
+module_param(rx_csum, bool, 0644);
+MODULE_PARM_DESC(rx_csum,
+		 "Drop received CAN frames with a bad checksum byte (assumed 8-bit sum of the message, unconfirmed)");
+
+static unsigned int rx_buf_size = MCBA_USB_RX_BUFF_SIZE;
+module_param(rx_buf_size, uint, 0644);
+MODULE_PARM_DESC(rx_buf_size,
+		 "RX URB buffer size in bytes, rounded down to a multiple of "
+		 __stringify(MCBA_USB_RX_BUFF_SIZE) " (max "
+		 __stringify(MCBA_USB_RX_BUFF_MAX) ", applied on interface up)");
+
+static unsigned int tx_prio_slots = 4;
+module_param(tx_prio_slots, uint, 0444);
+MODULE_PARM_DESC(tx_prio_slots,
+		 "TX contexts reserved for the priority TX queue, 0 for a single TX queue");
+
+static unsigned int capture_records = 65536;
+module_param(capture_records, uint, 0644);
+MODULE_PARM_DESC(capture_records,
+		 "Records in the debugfs capture ring, rounded up to a power of two (applied on open)");
+
+static bool capture_bypass;
+module_param(capture_bypass, bool, 0644);
+MODULE_PARM_DESC(capture_bypass,
+		 "Do not deliver captured CAN frames to SocketCAN while the debugfs capture file is open");
+
+/* Fault injection for soak tests, configured through the usual fault_attr
+ * knobs in debugfs mcba_usb/fail_<name>/ (see fault-injection.rst):
+ * fail_urb_submit fails usb_submit_urb() with -ENOMEM, fail_urb_complete
+ * turns a successful transfer into -EPROTO before the completion handler
+ * looks at it, fail_alloc fails RX skb and TX context allocation.
+ */
+#ifdef CONFIG_FAULT_INJECTION
+static DECLARE_FAULT_ATTR(mcba_fail_urb_submit);
+static DECLARE_FAULT_ATTR(mcba_fail_urb_complete);
+static DECLARE_FAULT_ATTR(mcba_fail_alloc);
+
+#define mcba_usb_should_fail(_attr, _size) \
+	unlikely(should_fail(&mcba_fail_##_attr, _size))
+#else
+#define mcba_usb_should_fail(_attr, _size) false
+#endif
+
+static int mcba_usb_submit_urb(struct urb *urb, gfp_t mem_flags)
+{
+	if (mcba_usb_should_fail(urb_submit, urb->transfer_buffer_length))
+		return -ENOMEM;
+
+	return usb_submit_urb(urb, mem_flags);
+}
+
+/* Called first thing by every completion handler */
+static void mcba_usb_fault_complete(struct urb *urb)
+{
+	if (!urb->status && mcba_usb_should_fail(urb_complete,
+						 urb->actual_length))
+		urb->status = -EPROTO;
+}
+
+/* Like the can-dev helpers, *cf is NULL when no skb was allocated */
+static struct sk_buff *mcba_usb_alloc_can_skb(struct net_device *netdev,
+					      struct can_frame **cf)
+{
+	if (mcba_usb_should_fail(alloc, sizeof(**cf))) {
+		*cf = NULL;
+		return NULL;
+	}
+
+	return alloc_can_skb(netdev, cf);
+}
+
+static struct sk_buff *mcba_usb_alloc_err_skb(struct net_device *netdev,
+					      struct can_frame **cf)
+{
+	if (mcba_usb_should_fail(alloc, sizeof(**cf))) {
+		*cf = NULL;
+		return NULL;
+	}
+
+	return alloc_can_err_skb(netdev, cf);
+}
+
 static const struct usb_device_id mcba_usb_table[] = {
 	{ USB_DEVICE(MCBA_VENDOR_ID, MCBA_PRODUCT_ID) },
 	{ } /* Terminating entry */
@@ -500,11 +875,19 @@ MODULE_DEVICE_TABLE(usb, mcba_usb_table);
 static netdev_tx_t mcba_usb_xmit(struct mcba_priv *priv,
 				 struct mcba_usb_msg *usb_msg,
 				 struct sk_buff *skb);
-static void mcba_usb_xmit_cmd(struct mcba_priv *priv,
-			      struct mcba_usb_msg *usb_msg);
 static void mcba_usb_xmit_read_fw_ver(struct mcba_priv *priv, u8 pic);
-static void mcba_usb_xmit_termination(struct mcba_priv *priv, u8 termination);
+static int mcba_usb_xmit_termination(struct mcba_priv *priv, u8 termination);
 static inline void mcba_init_ctx(struct mcba_priv *priv);
+static inline void mcba_usb_put_ctx(struct mcba_priv *priv,
+				    struct mcba_usb_ctx *ctx);
+static void mcba_usb_tx_wake(struct mcba_priv *priv);
+static void mcba_usb_write_bulk_callback(struct urb *urb);
+static void mcba_usb_free_tx_urbs(struct mcba_priv *priv);
+static void mcba_usb_stop(struct mcba_priv *priv);
+static int mcba_usb_queue_change_bitrate(struct mcba_priv *priv, u16 bitrate,
+					 unsigned int *ticket);
+static int mcba_usb_cmd_wait(struct mcba_priv *priv, int slot,
+			     unsigned int ticket);
 
 static ssize_t termination_show(struct device *dev,
 				struct device_attribute *attr, char *buf)
@@ -527,8 +910,17 @@ static ssize_t termination_store(struct device *dev,
 	ret = kstrtoint(buf, 10, &tmp);
 
 	if ((ret == 0) && ((tmp == 0) || (tmp == 1))) {
+		/* sent right away, the interface may be up or down */
+		ret = usb_autopm_get_interface(priv->intf);
+		if (ret)
+			return ret;
+
+		ret = mcba_usb_xmit_termination(priv, tmp);
+		usb_autopm_put_interface(priv->intf);
+		if (ret)
+			return ret;
+
 		priv->termination_state = tmp;
-		mcba_usb_xmit_termination(priv, priv->termination_state);
 	}
 
 	return count;
@@ -542,533 +934,3046 @@ static struct device_attribute termination_attr = {
 	.store	= termination_store
 };
 
-static void mcba_usb_process_can(struct mcba_priv *priv,
-				 struct mcba_usb_msg_can *msg)
+static ssize_t filter_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
 {
-	struct can_frame *cf;
-	struct sk_buff *skb;
-	struct net_device_stats *stats = &priv->netdev->stats;
-
-	skb = alloc_can_skb(priv->netdev, &cf);
-	if (!skb)
-		return;
-
-	if (MCBA_RX_IS_EXID(msg))
-		cf->can_id = MCBA_CAN_GET_EID(msg);
-	else
-		cf->can_id = MCBA_CAN_GET_SID(msg);
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	struct mcba_usb_rx_filter *flt;
+	ssize_t len = 0;
+	unsigned int i;
 
-	if (MCBA_RX_IS_RTR(msg))
-		cf->can_id |= MCBA_CAN_RTR_MASK;
+	rcu_read_lock();
 
-	cf->can_dlc = msg->dlc & MCBA_DLC_MASK;
+	flt = rcu_dereference(priv->rx_filter);
+	for (i = 0; flt && i < flt->cnt; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%08x:%08x\n",
+				 flt->f[i].can_id, flt->f[i].can_mask);
 
-	memcpy(cf->data, msg->data, cf->can_dlc);
+	rcu_read_unlock();
 
-	stats->rx_packets++;
-	stats->rx_bytes += cf->can_dlc;
-	netif_rx(skb);
+	return len;
 }
 
-static void mcba_usb_process_ka_usb(struct mcba_priv *priv,
-				    struct mcba_usb_msg_ka_usb *msg)
+/* Accepts whitespace separated <can_id>:<can_mask> pairs in hex, with the
+ * same meaning as CAN_RAW filters, CAN_INV_FILTER included. An empty write
+ * accepts all frames again.
+ */
+static ssize_t filter_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
 {
-	if (unlikely(MCBA_IS_USB_DEBUG())) {
-		netdev_info(priv->netdev,
-			    "USB_KA: termination %hhu, ver_maj %hhu, soft_min %hhu\n",
-			    msg->termination_state, msg->soft_ver_major,
-			    msg->soft_ver_minor);
-	}
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	struct can_filter f[MCBA_MAX_RX_FILTERS];
+	struct mcba_usb_rx_filter *flt = NULL;
+	struct mcba_usb_rx_filter *old;
+	unsigned int cnt = 0;
+	const char *p = buf;
+	int n;
+
+	for (;;) {
+		p = skip_spaces(p);
+		if (!*p)
+			break;
 
-	if (unlikely(priv->usb_ka_first_pass)) {
-		netdev_info(priv->netdev,
-			    "PIC USB version %hhu.%hhu\n",
-			    msg->soft_ver_major, msg->soft_ver_minor);
+		if (cnt == MCBA_MAX_RX_FILTERS)
+			return -ENOSPC;
 
-		priv->usb_ka_first_pass = false;
+		if (sscanf(p, "%x:%x%n", &f[cnt].can_id, &f[cnt].can_mask,
+			   &n) != 2)
+			return -EINVAL;
+
+		p += n;
+		cnt++;
 	}
 
-	priv->termination_state = msg->termination_state;
-}
+	if (cnt) {
+		flt = kmalloc(struct_size(flt, f, cnt), GFP_KERNEL);
+		if (!flt)
+			return -ENOMEM;
 
-static void mcba_usb_process_ka_can(struct mcba_priv *priv,
-				    struct mcba_usb_msg_ka_can *msg)
-{
-	if (unlikely(MCBA_IS_CAN_DEBUG())) {
-		netdev_info(priv->netdev,
-			    "CAN_KA: tx_err_cnt %hhu, rx_err_cnt %hhu, rx_buff_ovfl %hhu, tx_bus_off %hhu, can_bitrate %hu, rx_lost %hu, can_stat %hhu, soft_ver %hhu.%hhu, debug_mode %hhu, test_complete %hhu, test_result %hhu\n",
-			    msg->tx_err_cnt, msg->rx_err_cnt, msg->rx_buff_ovfl,
-			    msg->tx_bus_off,
-			    ((msg->can_bitrate_hi << 8) + msg->can_bitrate_lo),
-			    ((msg->rx_lost_hi >> 8) + msg->rx_lost_lo),
-			    msg->can_stat, msg->soft_ver_major,
-			    msg->soft_ver_minor,
-			    msg->debug_mode, msg->test_complete,
-			    msg->test_result);
+		flt->cnt = cnt;
+		memcpy(flt->f, f, cnt * sizeof(f[0]));
 	}
 
-	if (unlikely(priv->can_ka_first_pass)) {
-		netdev_info(priv->netdev,
-			    "PIC CAN version %hhu.%hhu\n",
-			    msg->soft_ver_major, msg->soft_ver_minor);
-
-		priv->can_ka_first_pass = false;
+	if (!rtnl_trylock()) {
+		kfree(flt);
+		return restart_syscall();
 	}
 
-	priv->bec.txerr = msg->tx_err_cnt;
-	priv->bec.rxerr = msg->rx_err_cnt;
-}
+	old = rcu_dereference_protected(priv->rx_filter,
+					lockdep_rtnl_is_held());
+	rcu_assign_pointer(priv->rx_filter, flt);
 
-static void mcba_usb_process_rx(struct mcba_priv *priv,
-				struct mcba_usb_msg *msg)
-{
-	switch (msg->cmd_id) {
-	case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
-		mcba_usb_process_ka_can(priv,
-					(struct mcba_usb_msg_ka_can *)msg);
-		break;
+	rtnl_unlock();
 
-	case MBCA_CMD_I_AM_ALIVE_FROM_USB:
-		mcba_usb_process_ka_usb(priv,
-					(struct mcba_usb_msg_ka_usb *)msg);
-		break;
+	if (old)
+		kfree_rcu(old, rcu);
 
-	case MBCA_CMD_RECEIVE_MESSAGE:
-		mcba_usb_process_can(priv, (struct mcba_usb_msg_can *)msg);
-		break;
+	return count;
+}
 
-	case MBCA_CMD_NOTHING_TO_SEND:
-		/* Side effect of communication between PIC_USB and PIC_CAN.
-		 * PIC_CAN is telling us that it has nothing to send
-		 */
-		break;
+static struct device_attribute filter_attr = {
+	.attr = {
+		.name = "filter",
+		.mode = 0644 },
+	.show	= filter_show,
+	.store	= filter_store
+};
 
-	case MBCA_CMD_TRANSMIT_MESSAGE_RSP:
-		/* Transmission response from the device containing timestamp */
-		break;
+static ssize_t rx_cpu_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
 
-	default:
-		netdev_warn(priv->netdev, "Unsupported msg (0x%hhX)",
-			    msg->cmd_id);
-		break;
-	}
+	return sprintf(buf, "%d\n", READ_ONCE(priv->rx_cpu));
 }
 
-/* Callback for reading data from device
- *
- * Check urb status, call read function and resubmit urb read operation.
+/* -1 runs NAPI on the CPU completing the URBs (usually the xHCI interrupt
+ * CPU), anything else moves RX processing and delivery to that CPU.
  */
-static void mcba_usb_read_bulk_callback(struct urb *urb)
+static ssize_t rx_cpu_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
 {
-	struct mcba_priv *priv = urb->context;
-	struct net_device *netdev;
-	int retval;
-	int pos = 0;
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	int cpu;
+	int ret;
 
-	netdev = priv->netdev;
+	ret = kstrtoint(buf, 10, &cpu);
+	if (ret)
+		return ret;
 
-	if (!netif_device_present(netdev))
-		return;
+	if (cpu < -1 || cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
 
-	switch (urb->status) {
-	case 0: /* success */
-		break;
+	WRITE_ONCE(priv->rx_cpu, cpu);
 
-	case -ENOENT:
-	case -ESHUTDOWN:
-		return;
+	return count;
+}
 
-	default:
-		netdev_info(netdev, "Rx URB aborted (%d)\n",
-			    urb->status);
+static struct device_attribute rx_cpu_attr = {
+	.attr = {
+		.name = "rx_cpu",
+		.mode = 0644 },
+	.show	= rx_cpu_show,
+	.store	= rx_cpu_store
+};
 
-		goto resubmit_urb;
-	}
+static ssize_t bitrate_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
 
-	while (pos < urb->actual_length) {
-		struct mcba_usb_msg *msg;
+	return sprintf(buf, "%u\n", priv->can.bittiming.bitrate);
+}
 
-		if (pos + sizeof(struct mcba_usb_msg) > urb->actual_length) {
-			netdev_err(priv->netdev, "format error\n");
-			break;
+/* Retune without ifdown. netlink refuses bittiming changes while the
+ * interface is up, but the firmware only needs CHANGE_BIT_RATE, so RX and
+ * TX keep running with all their URBs.
+ */
+static ssize_t bitrate_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	const struct bitrate_settings *settings;
+	unsigned int ticket;
+	bool running;
+	u32 bitrate;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &bitrate);
+	if (ret)
+		return ret;
+
+	settings = mcba_usb_find_bitrate(bitrate);
+	if (!settings)
+		return -EINVAL;
+
+	/* can.bittiming is read by netlink under RTNL */
+	if (!rtnl_trylock())
+		return restart_syscall();
+
+	running = netif_running(netdev);
+	if (running) {
+		ret = mcba_usb_queue_change_bitrate(priv, settings->kbps,
+						    &ticket);
+		if (ret) {
+			rtnl_unlock();
+			return ret;
 		}
+	}
 
-		msg = (struct mcba_usb_msg *)(urb->transfer_buffer + pos);
-		mcba_usb_process_rx(priv, msg);
+	/* Applied at once, so an open during the wait sends the new rate.
+	 * A command that timed out is still pending and goes out later.
+	 */
+	mcba_usb_apply_bitrate(priv, settings);
+
+	rtnl_unlock();
 
-		pos += sizeof(struct mcba_usb_msg);
+	/* the device may take MCBA_CMD_TIMEOUT, don't hold RTNL for it */
+	if (running) {
+		ret = mcba_usb_cmd_wait(priv, MCBA_CMD_SLOT_BITRATE, ticket);
+		if (ret)
+			return ret;
 	}
 
-resubmit_urb:
+	return count;
+}
 
-	usb_fill_bulk_urb(urb, priv->udev,
-			  usb_rcvbulkpipe(priv->udev, MCBA_USB_EP_OUT),
-			  urb->transfer_buffer, MCBA_USB_RX_BUFF_SIZE,
-			  mcba_usb_read_bulk_callback, priv);
+static struct device_attribute bitrate_attr = {
+	.attr = {
+		.name = "bitrate",
+		.mode = 0644 },
+	.show	= bitrate_show,
+	.store	= bitrate_store
+};
 
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
+static ssize_t tx_prio_id_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
 
-	if (retval == -ENODEV)
-		netif_device_detach(netdev);
-	else if (retval)
-		netdev_err(netdev, "failed resubmitting read bulk urb: %d\n",
-			   retval);
+	return sprintf(buf, "0x%03x\n", READ_ONCE(priv->tx_prio_id));
 }
 
-/* Start USB device */
-static int mcba_usb_start(struct mcba_priv *priv)
+/* Frames with a base ID below the written value take the priority queue,
+ * 0 leaves only SO_PRIORITY to select it.
+ */
+static ssize_t tx_prio_id_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	struct net_device *netdev = priv->netdev;
-	int err, i;
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	u16 id;
+	int ret;
 
-	for (i = 0; i < MCBA_MAX_RX_URBS; i++) {
-		struct urb *urb = NULL;
+	ret = kstrtou16(buf, 0, &id);
+	if (ret)
+		return ret;
+
+	if (id > CAN_SFF_MASK + 1)
+		return -EINVAL;
+
+	WRITE_ONCE(priv->tx_prio_id, id);
+
+	return count;
+}
+
+static struct device_attribute tx_prio_id_attr = {
+	.attr = {
+		.name = "tx_prio_id",
+		.mode = 0644 },
+	.show	= tx_prio_id_show,
+	.store	= tx_prio_id_store
+};
+
+static ssize_t tx_disable_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	return sprintf(buf, "%d\n", priv->tx_disable);
+}
+
+/* Drops every frame in the driver. This is not listen-only: the firmware
+ * can't take the MCP2515 off the bus, so it still ACKs and sends error
+ * frames.
+ */
+static ssize_t tx_disable_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+
+	/* TX URBs are allocated or not by mcba_usb_start() */
+	if (netif_running(netdev)) {
+		rtnl_unlock();
+		return -EBUSY;
+	}
+
+	priv->tx_disable = val;
+
+	rtnl_unlock();
+
+	return count;
+}
+
+static struct device_attribute tx_disable_attr = {
+	.attr = {
+		.name = "tx_disable",
+		.mode = 0644 },
+	.show	= tx_disable_show,
+	.store	= tx_disable_store
+};
+
+static inline unsigned long mcba_usb_load_frames(struct mcba_priv *priv)
+{
+	return atomic_long_read(&priv->rx_load.frames) +
+	       atomic_long_read(&priv->tx_load.frames);
+}
+
+static inline unsigned long mcba_usb_load_bits(struct mcba_priv *priv)
+{
+	return atomic_long_read(&priv->rx_load.bits) +
+	       atomic_long_read(&priv->tx_load.bits);
+}
+
+/* Bus load, one value per file under bus_load/ */
+#define MCBA_LOAD_ATTR(_name, _expr)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct mcba_priv *priv = netdev_priv(to_net_dev(dev));		\
+									\
+	return sprintf(buf, "%lu\n", (unsigned long)(_expr));		\
+}									\
+									\
+static struct device_attribute _name##_attr = {				\
+	.attr = {							\
+		.name = #_name,						\
+		.mode = 0444 },						\
+	.show	= _name##_show,						\
+}
+
+MCBA_LOAD_ATTR(frames_per_sec, READ_ONCE(priv->load.fps));
+MCBA_LOAD_ATTR(bits_per_sec, READ_ONCE(priv->load.bps));
+MCBA_LOAD_ATTR(peak_frames_per_sec, READ_ONCE(priv->load.peak_fps));
+MCBA_LOAD_ATTR(peak_bits_per_sec, READ_ONCE(priv->load.peak_bps));
+MCBA_LOAD_ATTR(load_permille, READ_ONCE(priv->load.permille));
+MCBA_LOAD_ATTR(load_avg_permille, ewma_busload_read(&priv->load.avg));
+MCBA_LOAD_ATTR(frames, mcba_usb_load_frames(priv));
+MCBA_LOAD_ATTR(bits, mcba_usb_load_bits(priv));
+
+static struct attribute *mcba_usb_load_attrs[] = {
+	&frames_per_sec_attr.attr,
+	&bits_per_sec_attr.attr,
+	&peak_frames_per_sec_attr.attr,
+	&peak_bits_per_sec_attr.attr,
+	&load_permille_attr.attr,
+	&load_avg_permille_attr.attr,
+	&frames_attr.attr,
+	&bits_attr.attr,
+	NULL
+};
+
+static const struct attribute_group mcba_usb_load_group = {
+	.name = "bus_load",
+	.attrs = mcba_usb_load_attrs,
+};
+
+static ssize_t mcba_usb_fw_ver_show(char *buf, u16 ver)
+{
+	if (!ver)
+		return -ENODATA;
+
+	return sprintf(buf, "%u.%u\n", ver >> 8, ver & 0xff);
+}
+
+static ssize_t usb_fw_version_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	return mcba_usb_fw_ver_show(buf, READ_ONCE(priv->fw_ver_usb));
+}
+
+static struct device_attribute usb_fw_version_attr = {
+	.attr = {
+		.name = "usb_fw_version",
+		.mode = 0444 },
+	.show	= usb_fw_version_show,
+};
+
+static ssize_t can_fw_version_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	return mcba_usb_fw_ver_show(buf, READ_ONCE(priv->fw_ver_can));
+}
+
+static struct device_attribute can_fw_version_attr = {
+	.attr = {
+		.name = "can_fw_version",
+		.mode = 0444 },
+	.show	= can_fw_version_show,
+};
+
+static u64 mcba_usb_lat_start(void)
+{
+	return lat_hist ? ktime_get_ns() : 0;
+}
+
+/* RX counters are only updated from poll and from xmit with BH disabled */
+static inline void mcba_usb_stats_rx(struct mcba_priv *priv, unsigned int len)
+{
+	struct mcba_usb_pcpu_stats *st = this_cpu_ptr(priv->rx_stats);
+
+	u64_stats_update_begin(&st->syncp);
+	st->packets++;
+	st->bytes += len;
+	u64_stats_update_end(&st->syncp);
+}
+
+/* TX completions may come from hard IRQ and interrupt an update from poll */
+static inline void mcba_usb_stats_tx(struct mcba_priv *priv, unsigned int len)
+{
+	struct mcba_usb_pcpu_stats *st;
+	unsigned long flags;
+
+	local_irq_save(flags);
+
+	st = this_cpu_ptr(priv->tx_stats);
+	u64_stats_update_begin(&st->syncp);
+	st->packets++;
+	st->bytes += len;
+	u64_stats_update_end(&st->syncp);
+
+	local_irq_restore(flags);
+}
+
+/* start_ns is 0 if lat_hist was off when the measurement began */
+static void mcba_usb_lat_add(struct mcba_usb_lat_hist *hist, u64 start_ns)
+{
+	u64 us;
+	unsigned int n = 0;
+
+	if (!lat_hist || !start_ns)
+		return;
+
+	us = div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC);
+	if (us)
+		n = min_t(unsigned int, ilog2(us) + 1, MCBA_LAT_BUCKETS - 1);
+
+	hist->cnt[n]++;
+}
+
+/* Frame length on the wire, for BQL and the bus load. Worst case is a stuff
+ * bit every 4 bits, typical payloads need about half of that. The message
+ * is in device format, so this works for both directions.
+ */
+static unsigned int mcba_usb_msg_bits(const struct mcba_usb_msg_can *msg)
+{
+	unsigned int bits;
+
+	bits = MCBA_RX_IS_EXID(msg) ? MCBA_CAN_EFF_STUFFED_BITS :
+				      MCBA_CAN_SFF_STUFFED_BITS;
+
+	if (!MCBA_RX_IS_RTR(msg))
+		bits += get_can_dlc(msg->dlc & MCBA_DLC_MASK) * 8;
+
+	return bits + (bits - 1) / 8 + MCBA_CAN_TAIL_BITS;
+}
+
+static u64 mcba_usb_cc_read(const struct cyclecounter *cc)
+{
+	struct mcba_priv *priv = container_of(cc, struct mcba_priv, cc);
+
+	return priv->ts_raw;
+}
+
+static void mcba_usb_init_ts(struct mcba_priv *priv)
+{
+	priv->cc.read = mcba_usb_cc_read;
+	priv->cc.mask = CYCLECOUNTER_MASK(32);
+	clocks_calc_mult_shift(&priv->cc.mult, &priv->cc.shift, MCBA_TS_FREQ,
+			       NSEC_PER_SEC, U32_MAX / MCBA_TS_FREQ + 1);
+
+	priv->ts_mult = priv->cc.mult;
+	priv->ts_ppb = 0;
+	priv->ts_valid = false;
+}
+
+/* Ask poll to re-anchor, the timecounter is only touched from there */
+static void mcba_usb_ts_resync(struct mcba_priv *priv)
+{
+	set_bit(0, &priv->ts_resync);
+}
+
+/* End of a steering window. USB latency only ever adds to host minus
+ * device time, so the smallest offset seen is closest to the clock error.
+ */
+static void mcba_usb_ts_adjust(struct mcba_priv *priv, u64 now)
+{
+	s64 off = clamp_t(s64, priv->ts_min_off, -MCBA_TS_ADJ_NS,
+			  MCBA_TS_ADJ_NS);
+	s64 ppb;
+
+	/* half the rate error per window, the phase step does the rest */
+	ppb = priv->ts_ppb + div64_s64(off * NSEC_PER_SEC,
+				       2 * (s64)(now - priv->ts_adj_ns));
+	priv->ts_ppb = clamp_t(s64, ppb, -MCBA_TS_MAX_PPB, MCBA_TS_MAX_PPB);
+
+	/* tc was read just now, the new mult counts from there */
+	priv->cc.mult = priv->ts_mult +
+			div_s64((s64)priv->ts_mult * priv->ts_ppb, NSEC_PER_SEC);
+
+	/* may go back in time by up to MCBA_TS_MAX_STEP_NS */
+	priv->tc.nsec += clamp_t(s64, off, -MCBA_TS_MAX_STEP_NS,
+				 MCBA_TS_MAX_STEP_NS);
+
+	priv->ts_adj_ns = now;
+	priv->ts_min_off = S64_MAX;
+}
+
+/* Convert device timestamp to host time (ns), poll only */
+static u64 mcba_usb_ts_to_ns(struct mcba_priv *priv, u32 ts)
+{
+	u64 now = ktime_get_real_ns();
+	u64 ns;
+
+	priv->ts_raw = ts;
+
+	if (unlikely(test_bit(0, &priv->ts_resync)) &&
+	    test_and_clear_bit(0, &priv->ts_resync))
+		priv->ts_valid = false;
+
+	if (unlikely(!priv->ts_valid ||
+		     now - priv->ts_host_ns > MCBA_TS_RESYNC_NS)) {
+		timecounter_init(&priv->tc, &priv->cc, now);
+		priv->ts_valid = true;
+		priv->ts_adj_ns = now;
+		priv->ts_min_off = S64_MAX;
+	}
+
+	priv->ts_host_ns = now;
+
+	ns = timecounter_read(&priv->tc);
+
+	priv->ts_min_off = min_t(s64, priv->ts_min_off, now - ns);
+	if (unlikely(now - priv->ts_adj_ns >= MCBA_TS_ADJ_NS))
+		mcba_usb_ts_adjust(priv, now);
+
+	return ns;
+}
+
+static bool mcba_usb_rx_accept(struct mcba_priv *priv, canid_t can_id)
+{
+	struct mcba_usb_rx_filter *flt;
+	bool accept = true;
+	unsigned int i;
+
+	rcu_read_lock();
+
+	flt = rcu_dereference(priv->rx_filter);
+	if (flt) {
+		accept = false;
+
+		for (i = 0; i < flt->cnt; i++) {
+			canid_t id = flt->f[i].can_id;
+			canid_t mask = flt->f[i].can_mask & ~CAN_INV_FILTER;
+			bool match = !((can_id ^ id) & mask);
+
+			/* like CAN_RAW, an inverted filter takes the rest */
+			if (match != !!(id & CAN_INV_FILTER)) {
+				accept = true;
+				break;
+			}
+		}
+	}
+
+	rcu_read_unlock();
+
+	return accept;
+}
+
+static inline void mcba_usb_load_add(struct mcba_usb_load_cnt *cnt,
+				     unsigned int bits)
+{
+	atomic_long_inc(&cnt->frames);
+	atomic_long_add(bits, &cnt->bits);
+}
+
+static void mcba_usb_load_timer(struct timer_list *t)
+{
+	struct mcba_priv *priv = from_timer(priv, t, load.timer);
+	struct mcba_usb_load *load = &priv->load;
+	unsigned long frames = mcba_usb_load_frames(priv);
+	unsigned long bits = mcba_usb_load_bits(priv);
+	unsigned long elapsed = jiffies - load->last_jiffies;
+	u32 bitrate = priv->can.bittiming.bitrate;
+	unsigned long fps, bps;
+
+	/* the timer may fire late, scale to one second */
+	if (elapsed) {
+		fps = (frames - load->last_frames) * HZ / elapsed;
+		bps = (bits - load->last_bits) * HZ / elapsed;
+
+		WRITE_ONCE(load->fps, fps);
+		WRITE_ONCE(load->bps, bps);
+		WRITE_ONCE(load->peak_fps, max(load->peak_fps, fps));
+		WRITE_ONCE(load->peak_bps, max(load->peak_bps, bps));
+		WRITE_ONCE(load->permille,
+			   bitrate ? div_u64((u64)bps * 1000, bitrate) : 0);
+		ewma_busload_add(&load->avg, load->permille);
+	}
+
+	load->last_frames = frames;
+	load->last_bits = bits;
+	load->last_jiffies += elapsed;
+
+	mod_timer(&load->timer, jiffies + HZ);
+}
+
+/* Rates and peaks start over whenever the interface goes up */
+static void mcba_usb_load_start(struct mcba_priv *priv)
+{
+	struct mcba_usb_load *load = &priv->load;
+
+	load->last_frames = mcba_usb_load_frames(priv);
+	load->last_bits = mcba_usb_load_bits(priv);
+	load->last_jiffies = jiffies;
+
+	load->fps = 0;
+	load->bps = 0;
+	load->peak_fps = 0;
+	load->peak_bps = 0;
+	load->permille = 0;
+	ewma_busload_init(&load->avg);
+
+	mod_timer(&load->timer, jiffies + HZ);
+}
+
+/* Data bytes kept for each DLC, the record always carries all 8 */
+static const u64 mcba_usb_dlc_mask[CAN_MAX_DLEN + 1] = {
+	0x0000000000000000ULL, 0x00000000000000ffULL, 0x000000000000ffffULL,
+	0x0000000000ffffffULL, 0x00000000ffffffffULL, 0x000000ffffffffffULL,
+	0x0000ffffffffffffULL, 0x00ffffffffffffffULL, 0xffffffffffffffffULL
+};
+
+/* Copy a RECEIVE_MESSAGE record to the capture ring, if one is open.
+ * Returns true if SocketCAN delivery is to be skipped.
+ */
+static bool mcba_usb_cap_store(struct mcba_priv *priv,
+			       const struct mcba_usb_msg_can *msg)
+{
+	struct mcba_usb_cap *cap;
+	struct mcba_cap_rec *rec;
+	bool bypass = false;
+	u64 tail;
+
+	rcu_read_lock();
+
+	cap = rcu_dereference(priv->cap);
+	if (!cap)
+		goto out;
+
+	bypass = capture_bypass;
+
+	/* tail is written by userspace, a bogus one only causes drops */
+	tail = smp_load_acquire(&cap->hdr->tail);
+	if (cap->head - tail > cap->mask) {
+		WRITE_ONCE(cap->hdr->dropped, cap->hdr->dropped + 1);
+		goto out;
+	}
+
+	rec = &cap->rec[cap->head & cap->mask];
+	rec->ts_ns = mcba_usb_ts_to_ns(priv,
+				       get_unaligned_le32(msg->timestamp));
+	memcpy(rec->msg, msg, sizeof(rec->msg));
+	cap->head++;
+
+out:
+	rcu_read_unlock();
+
+	return bypass;
+}
+
+/* Publish the records stored by this poll and wake up the reader */
+static void mcba_usb_cap_flush(struct mcba_priv *priv)
+{
+	struct mcba_usb_cap *cap;
+
+	rcu_read_lock();
+
+	cap = rcu_dereference(priv->cap);
+	if (cap && READ_ONCE(cap->hdr->head) != cap->head) {
+		smp_store_release(&cap->hdr->head, cap->head);
+
+		if (wq_has_sleeper(&cap->wait))
+			wake_up_interruptible(&cap->wait);
+	}
+
+	rcu_read_unlock();
+}
+
+/* RX fast path, called for every RECEIVE_MESSAGE record. The frame is
+ * decoded straight from the URB buffer into the skb.
+ */
+static void mcba_usb_process_can(struct mcba_priv *priv,
+				 struct mcba_usb_msg_can *msg)
+{
+	struct can_frame *cf;
+	struct sk_buff *skb;
+	struct net_device_stats *stats = &priv->netdev->stats;
+	canid_t can_id;
+	u8 dlc;
+
+	if (unlikely(rx_csum) && unlikely(!mcba_usb_csum_ok(msg))) {
+		stats->rx_errors++;
+		stats->rx_crc_errors++;
+		priv->rx_xstats.rx_csum_err++;
+
+		/* a wrong guess at the algorithm drops every frame */
+		if (net_ratelimit())
+			netdev_warn(priv->netdev,
+				    "bad checksum 0x%02hhx (sum 0x%02hhx), frame dropped, see rx_csum\n",
+				    msg->checksum, mcba_usb_csum(msg));
+		return;
+	}
+
+	/* everything on the bus counts, whether we want it or not */
+	mcba_usb_load_add(&priv->rx_load, mcba_usb_msg_bits(msg));
+
+	if (unlikely(rcu_access_pointer(priv->cap)) &&
+	    mcba_usb_cap_store(priv, msg))
+		return;
+
+	can_id = mcba_usb_decode_id(msg);
+
+	if (MCBA_RX_IS_RTR(msg))
+		can_id |= MCBA_CAN_RTR_MASK;
+
+	/* unwanted frames never cost an skb */
+	if (!mcba_usb_rx_accept(priv, can_id)) {
+		priv->rx_xstats.rx_filtered++;
+		return;
+	}
+
+	skb = mcba_usb_alloc_can_skb(priv->netdev, &cf);
+	if (!skb) {
+		stats->rx_dropped++;
+		priv->rx_xstats.rx_alloc_err++;
+		return;
+	}
+
+	/* DLC 9..15 means 8 data bytes */
+	dlc = get_can_dlc(msg->dlc & MCBA_DLC_MASK);
+
+	cf->can_id = can_id;
+	cf->can_dlc = dlc;
+
+	/* cf->data is 8 byte aligned, bytes past DLC stay zero */
+	put_unaligned_le64(get_unaligned_le64(msg->data) &
+			   mcba_usb_dlc_mask[dlc], cf->data);
+
+	if (priv->hwts_cfg.rx_filter != HWTSTAMP_FILTER_NONE) {
+		u32 ts = get_unaligned_le32(msg->timestamp);
+
+		skb_hwtstamps(skb)->hwtstamp =
+			ns_to_ktime(mcba_usb_ts_to_ns(priv, ts));
+	}
+
+	trace_mcba_usb_rx_frame(priv->netdev, cf->can_id, cf->can_dlc);
+
+	mcba_usb_stats_rx(priv, cf->can_dlc);
+	netif_receive_skb(skb);
+
+	mcba_usb_lat_add(&priv->rx_lat, priv->rx_done_ns);
+}
+
+/* Frame went out on the wire. Response has RECEIVE_MESSAGE layout. */
+static void mcba_usb_process_tx_rsp(struct mcba_priv *priv,
+				    struct mcba_usb_msg_can *msg)
+{
+	struct net_device *netdev = priv->netdev;
+	struct mcba_usb_ctx *ctx;
+	struct sk_buff *skb;
+	unsigned long flags;
+	u8 ndx;
+
+	if (!priv->echo_rsp)
+		return;
+
+	spin_lock_irqsave(&priv->rsp_lock, flags);
+
+	if (priv->rsp_head == priv->rsp_tail) {
+		spin_unlock_irqrestore(&priv->rsp_lock, flags);
+		netdev_warn(netdev, "unexpected transmission response\n");
+		return;
+	}
+
+	ndx = priv->rsp_fifo[priv->rsp_head++ % MCBA_MAX_TX_URBS];
+
+	spin_unlock_irqrestore(&priv->rsp_lock, flags);
+
+	ctx = &priv->tx_context[ndx];
+
+	skb = priv->can.echo_skb[ndx];
+	if (skb && priv->hwts_cfg.tx_type == HWTSTAMP_TX_ON) {
+		u32 ts = get_unaligned_le32(msg->timestamp);
+
+		skb_hwtstamps(skb)->hwtstamp =
+			ns_to_ktime(mcba_usb_ts_to_ns(priv, ts));
+	}
+
+	mcba_usb_stats_tx(priv, ctx->dlc);
+	mcba_usb_load_add(&priv->tx_load, ctx->bits);
+	netdev_tx_completed_queue(netdev_get_tx_queue(netdev, ctx->txq), 1,
+				  ctx->len);
+
+	trace_mcba_usb_echo(netdev, ndx);
+	can_get_echo_skb(netdev, ndx);
+
+	mcba_usb_put_ctx(priv, ctx);
+
+	mcba_usb_tx_wake(priv);
+}
+
+/* Called for every keep alive from RX. tx_batch_ok sits with the TX
+ * members, so it is only written when it changes.
+ */
+static void mcba_usb_update_tx_batch(struct mcba_priv *priv)
+{
+	bool ok = tx_batch && priv->fw_ver_usb >= MCBA_TX_BATCH_MIN_FW_VER;
+
+	if (READ_ONCE(priv->tx_batch_ok) != ok)
+		WRITE_ONCE(priv->tx_batch_ok, ok);
+}
+
+static void mcba_usb_process_ka_usb(struct mcba_priv *priv,
+				    struct mcba_usb_msg_ka_usb *msg)
+{
+	if (unlikely(MCBA_IS_USB_DEBUG())) {
+		netdev_info(priv->netdev,
+			    "USB_KA: termination %hhu, ver_maj %hhu, soft_min %hhu\n",
+			    msg->termination_state, msg->soft_ver_major,
+			    msg->soft_ver_minor);
+	}
+
+	if (unlikely(priv->usb_ka_first_pass)) {
+		netdev_info(priv->netdev,
+			    "PIC USB version %hhu.%hhu\n",
+			    msg->soft_ver_major, msg->soft_ver_minor);
+
+		priv->usb_ka_first_pass = false;
+	}
+
+	priv->termination_state = msg->termination_state;
+	WRITE_ONCE(priv->fw_ver_usb, MCBA_FW_VER(msg->soft_ver_major,
+						 msg->soft_ver_minor));
+	mcba_usb_update_tx_batch(priv);
+}
+
+/* Error counters are only as fresh as the last PIC_CAN keep alive */
+static enum can_state mcba_usb_err_state(u8 err_cnt, u8 eflg, u8 warn_mask,
+					 u8 passive_mask)
+{
+	if (err_cnt >= 128 || (eflg & passive_mask))
+		return CAN_STATE_ERROR_PASSIVE;
+
+	if (err_cnt >= 96 || (eflg & warn_mask))
+		return CAN_STATE_ERROR_WARNING;
+
+	return CAN_STATE_ERROR_ACTIVE;
+}
+
+/* Derive the CAN state from the keep alive and report transitions and
+ * controller overflows as error frames.
+ */
+static void mcba_usb_process_can_state(struct mcba_priv *priv,
+				       struct mcba_usb_msg_ka_can *msg,
+				       bool overflow)
+{
+	struct net_device *netdev = priv->netdev;
+	enum can_state tx_state, rx_state, new_state;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	/* bus-off is only left through a restart, see mcba_net_set_mode() */
+	if (priv->can.state == CAN_STATE_BUS_OFF ||
+	    priv->can.state == CAN_STATE_STOPPED)
+		return;
+
+	if (msg->tx_bus_off || (msg->can_stat & MCBA_EFLG_TXBO)) {
+		tx_state = CAN_STATE_BUS_OFF;
+		rx_state = CAN_STATE_BUS_OFF;
+	} else {
+		tx_state = mcba_usb_err_state(msg->tx_err_cnt, msg->can_stat,
+					      MCBA_EFLG_TXWAR, MCBA_EFLG_TXEP);
+		rx_state = mcba_usb_err_state(msg->rx_err_cnt, msg->can_stat,
+					      MCBA_EFLG_RXWAR, MCBA_EFLG_RXEP);
+	}
+
+	new_state = max(tx_state, rx_state);
+
+	if (new_state == priv->can.state && !overflow)
+		return;
+
+	skb = mcba_usb_alloc_err_skb(netdev, &cf);
+
+	if (new_state != priv->can.state) {
+		/* only the side(s) which caused the transition is reported */
+		can_change_state(netdev, cf,
+				 tx_state == new_state ? tx_state : 0,
+				 rx_state == new_state ? rx_state : 0);
+
+		if (new_state == CAN_STATE_BUS_OFF)
+			can_bus_off(netdev);
+	}
+
+	if (!skb) {
+		priv->rx_xstats.rx_alloc_err++;
+		return;
+	}
+
+	if (overflow) {
+		cf->can_id |= CAN_ERR_CRTL;
+		cf->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+	}
+
+	cf->data[6] = msg->tx_err_cnt;
+	cf->data[7] = msg->rx_err_cnt;
+
+	mcba_usb_stats_rx(priv, cf->can_dlc);
+	netif_receive_skb(skb);
+}
+
+static void mcba_usb_process_ka_can(struct mcba_priv *priv,
+				    struct mcba_usb_msg_ka_can *msg)
+{
+	struct net_device_stats *stats = &priv->netdev->stats;
+	u16 rx_lost = (msg->rx_lost_hi << 8) + msg->rx_lost_lo;
+	bool overflow = false;
+
+	if (unlikely(MCBA_IS_CAN_DEBUG())) {
+		netdev_info(priv->netdev,
+			    "CAN_KA: tx_err_cnt %hhu, rx_err_cnt %hhu, rx_buff_ovfl %hhu, tx_bus_off %hhu, can_bitrate %hu, rx_lost %hu, can_stat %hhu, soft_ver %hhu.%hhu, debug_mode %hhu, test_complete %hhu, test_result %hhu\n",
+			    msg->tx_err_cnt, msg->rx_err_cnt, msg->rx_buff_ovfl,
+			    msg->tx_bus_off,
+			    ((msg->can_bitrate_hi << 8) + msg->can_bitrate_lo),
+			    rx_lost,
+			    msg->can_stat, msg->soft_ver_major,
+			    msg->soft_ver_minor,
+			    msg->debug_mode, msg->test_complete,
+			    msg->test_result);
+	}
+
+	if (unlikely(priv->can_ka_first_pass)) {
+		netdev_info(priv->netdev,
+			    "PIC CAN version %hhu.%hhu\n",
+			    msg->soft_ver_major, msg->soft_ver_minor);
+
+		priv->can_ka_first_pass = false;
+	}
+
+	WRITE_ONCE(priv->fw_ver_can, MCBA_FW_VER(msg->soft_ver_major,
+						 msg->soft_ver_minor));
+
+	priv->bec.txerr = msg->tx_err_cnt;
+	priv->bec.rxerr = msg->rx_err_cnt;
+
+	/* Firmware counters are free running since device power up, the
+	 * first keep alive after open only sets the baseline.
+	 */
+	if (priv->ka_can_valid) {
+		u8 ovfl = msg->rx_buff_ovfl - priv->ka_rx_buff_ovfl;
+		u16 lost = rx_lost - priv->ka_rx_lost;
+		/* overflow flags are latched, count the rising edges */
+		u8 rxovr = hweight8(msg->can_stat & ~priv->ka_can_stat &
+				    MCBA_EFLG_RXOVR);
+
+		stats->rx_over_errors += ovfl;
+		stats->rx_missed_errors += lost;
+		stats->rx_fifo_errors += rxovr;
+		stats->rx_errors += ovfl + lost + rxovr;
+
+		priv->rx_xstats.fw_rx_buff_ovfl += ovfl;
+		priv->rx_xstats.fw_rx_lost += lost;
+
+		overflow = ovfl || rxovr;
+	}
+
+	priv->ka_can_valid = true;
+	priv->ka_rx_buff_ovfl = msg->rx_buff_ovfl;
+	priv->ka_rx_lost = rx_lost;
+	priv->ka_can_stat = msg->can_stat;
+
+	priv->rx_xstats.fw_tx_bus_off = msg->tx_bus_off;
+	priv->rx_xstats.fw_can_stat = msg->can_stat;
+
+	mcba_usb_process_can_state(priv, msg, overflow);
+}
+
+/* RX slow path, RECEIVE_MESSAGE is handled by mcba_usb_process_urb() */
+static void mcba_usb_process_rx(struct mcba_priv *priv,
+				struct mcba_usb_msg *msg)
+{
+	switch (msg->cmd_id) {
+	case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
+		mcba_usb_process_ka_can(priv,
+					(struct mcba_usb_msg_ka_can *)msg);
+		break;
+
+	case MBCA_CMD_I_AM_ALIVE_FROM_USB:
+		mcba_usb_process_ka_usb(priv,
+					(struct mcba_usb_msg_ka_usb *)msg);
+		break;
+
+	case MBCA_CMD_NOTHING_TO_SEND:
+		/* Side effect of communication between PIC_USB and PIC_CAN.
+		 * PIC_CAN is telling us that it has nothing to send
+		 */
+		break;
+
+	case MBCA_CMD_TRANSMIT_MESSAGE_RSP:
+		/* Transmission response from the device containing timestamp */
+		mcba_usb_process_tx_rsp(priv, (struct mcba_usb_msg_can *)msg);
+		break;
+
+	default:
+		netdev_warn(priv->netdev, "Unsupported msg (0x%hhX)",
+			    msg->cmd_id);
+		break;
+	}
+}
+
+static void mcba_usb_read_bulk_callback(struct urb *urb);
+
+static void mcba_usb_rx_resubmit(struct mcba_priv *priv, struct urb *urb)
+{
+	struct net_device *netdev = priv->netdev;
+	int retval;
+
+	usb_fill_bulk_urb(urb, priv->udev,
+			  usb_rcvbulkpipe(priv->udev, MCBA_USB_EP_IN),
+			  urb->transfer_buffer, priv->rx_buf_size,
+			  mcba_usb_read_bulk_callback, urb->context);
+
+	usb_anchor_urb(urb, &priv->rx_submitted);
+
+	retval = mcba_usb_submit_urb(urb, GFP_ATOMIC);
+	trace_mcba_usb_rx_submit(netdev, urb, priv->rx_buf_size, retval);
+	if (!retval)
+		return;
+
+	usb_unanchor_urb(urb);
+	priv->rx_xstats.rx_resubmit_err++;
+
+	if (retval == -ENODEV) {
+		netif_device_detach(netdev);
+		return;
+	}
+
+	/* a failing host controller fails every resubmit */
+	if (net_ratelimit())
+		netdev_err(netdev, "failed resubmitting read bulk urb: %d\n",
+			   retval);
+
+	/* Losing the URB for good would starve RX once all of them are gone.
+	 * Park it for mcba_usb_poll(), which never runs after mcba_usb_stop()
+	 * disabled NAPI.
+	 */
+	usb_anchor_urb(urb, &priv->rx_failed);
+	if (!timer_pending(&priv->rx_retry))
+		mod_timer(&priv->rx_retry, jiffies + MCBA_RX_RETRY);
+}
+
+static void mcba_usb_rx_work(struct work_struct *work)
+{
+	struct mcba_priv *priv = container_of(work, struct mcba_priv, rx_work);
+
+	/* NET_RX runs on this CPU from local_bh_enable() */
+	local_bh_disable();
+	napi_schedule(&priv->napi);
+	local_bh_enable();
+}
+
+/* NAPI polls on the CPU that scheduled it until it completes, so hand the
+ * scheduling over to rx_cpu if one is configured. A pending work item picks
+ * up every URB anchored to rx_done before it runs.
+ */
+static void mcba_usb_rx_kick(struct mcba_priv *priv)
+{
+	int cpu = READ_ONCE(priv->rx_cpu);
+
+	if (cpu < 0 || cpu == smp_processor_id() || !cpu_online(cpu)) {
+		napi_schedule(&priv->napi);
+		return;
+	}
+
+	queue_work_on(cpu, system_highpri_wq, &priv->rx_work);
+}
+
+static void mcba_usb_rx_retry(struct timer_list *t)
+{
+	struct mcba_priv *priv = from_timer(priv, t, rx_retry);
+
+	mcba_usb_rx_kick(priv);
+}
+
+static enum hrtimer_restart mcba_usb_rx_coal_timer(struct hrtimer *t)
+{
+	struct mcba_priv *priv = container_of(t, struct mcba_priv,
+					      rx_coal_timer);
+
+	mcba_usb_rx_kick(priv);
+
+	return HRTIMER_NORESTART;
+}
+
+static bool mcba_usb_rx_idle(struct mcba_priv *priv)
+{
+	return READ_ONCE(priv->rx_adaptive) &&
+	       time_after(jiffies, READ_ONCE(priv->rx_busy) + MCBA_RX_IDLE);
+}
+
+/* Cheap look for CAN frames or TX echoes in a completed transfer. Records
+ * behind a split one are not at these offsets, mcba_usb_dispatch_rx()
+ * will still see them.
+ */
+static bool mcba_usb_rx_has_traffic(struct urb *urb)
+{
+	const u8 *buf = urb->transfer_buffer;
+	unsigned int pos;
+
+	for (pos = 0; pos < urb->actual_length; pos += MCBA_USB_MSG_SIZE)
+		if (buf[pos] == MBCA_CMD_RECEIVE_MESSAGE ||
+		    buf[pos] == MBCA_CMD_TRANSMIT_MESSAGE_RSP)
+			return true;
+
+	return false;
+}
+
+/* Interrupt moderation for RX completions: NAPI is kicked after rx_frames
+ * completions or rx_usecs after the first one, whichever comes first. An
+ * idle bus, with adaptive-rx, uses rx_usecs_low instead so a device
+ * flooding keep alives and NOTHING_TO_SEND costs fewer polls.
+ */
+static void mcba_usb_rx_coalesce(struct mcba_priv *priv, struct urb *urb)
+{
+	unsigned int usecs = READ_ONCE(priv->rx_usecs);
+
+	if (mcba_usb_rx_idle(priv) && !mcba_usb_rx_has_traffic(urb))
+		usecs = READ_ONCE(priv->rx_usecs_low);
+
+	if (!usecs || atomic_inc_return(&priv->rx_coal_cnt) >=
+		      READ_ONCE(priv->rx_frames)) {
+		hrtimer_try_to_cancel(&priv->rx_coal_timer);
+		mcba_usb_rx_kick(priv);
+		return;
+	}
+
+	/* a running timer covers this completion too */
+	if (!hrtimer_is_queued(&priv->rx_coal_timer))
+		hrtimer_start(&priv->rx_coal_timer, us_to_ktime(usecs),
+			      HRTIMER_MODE_REL);
+}
+
+/* Callback for reading data from device
+ *
+ * Check urb status and hand the transfer over to NAPI. The urb is resubmitted
+ * by the poll function once its messages are consumed, so a slow consumer
+ * throttles the device instead of growing a backlog.
+ */
+static void mcba_usb_read_bulk_callback(struct urb *urb)
+{
+	struct mcba_usb_rx_urb *rx = urb->context;
+	struct mcba_priv *priv = rx->priv;
+	struct net_device *netdev;
+
+	netdev = priv->netdev;
+
+	mcba_usb_fault_complete(urb);
+
+	trace_mcba_usb_rx_complete(netdev, urb, urb->actual_length,
+				   urb->status);
+
+	if (!netif_device_present(netdev))
+		return;
+
+	switch (urb->status) {
+	case 0: /* success */
+		break;
+
+	case -ENOENT:
+	case -ESHUTDOWN:
+		return;
+
+	default:
+		netdev_info(netdev, "Rx URB aborted (%d)\n",
+			    urb->status);
+
+		mcba_usb_rx_resubmit(priv, urb);
+		return;
+	}
+
+	rx->done_ns = mcba_usb_lat_start();
+
+	usb_anchor_urb(urb, &priv->rx_done);
+	mcba_usb_rx_coalesce(priv, urb);
+}
+
+/* Hand one RX record to its handler, called by mcba_usb_rx_parse() */
+static void mcba_usb_dispatch_rx(void *ctx, struct mcba_usb_msg *msg)
+{
+	struct mcba_priv *priv = ctx;
+
+	if (likely(msg->cmd_id == MBCA_CMD_RECEIVE_MESSAGE)) {
+		priv->rx_busy = jiffies;
+		mcba_usb_process_can(priv, (struct mcba_usb_msg_can *)msg);
+	} else {
+		if (msg->cmd_id == MBCA_CMD_TRANSMIT_MESSAGE_RSP)
+			priv->rx_busy = jiffies;
+		mcba_usb_process_rx(priv, msg);
+	}
+}
+
+static void mcba_usb_rx_format_err(void *ctx, u8 cmd_id)
+{
+	struct mcba_priv *priv = ctx;
+
+	priv->rx_xstats.rx_format_err++;
+
+	if (net_ratelimit())
+		netdev_warn(priv->netdev,
+			    "format error (0x%02hhx), resynchronizing\n",
+			    cmd_id);
+}
+
+/* Parse one completed transfer, returns number of messages processed */
+static int mcba_usb_process_urb(struct mcba_priv *priv, struct urb *urb)
+{
+	BUILD_BUG_ON(sizeof(struct mcba_usb_msg) != MCBA_USB_MSG_SIZE);
+
+	return mcba_usb_rx_parse(&priv->rx_parser, urb->transfer_buffer,
+				 urb->actual_length, rx_csum,
+				 mcba_usb_dispatch_rx, mcba_usb_rx_format_err,
+				 priv);
+}
+
+/* Back to full depth at once, traffic comes in bursts */
+static void mcba_usb_rx_unpark(struct mcba_priv *priv)
+{
+	struct urb *urb;
+
+	while ((urb = usb_get_from_anchor(&priv->rx_parked))) {
+		priv->rx_parked_cnt--;
+		priv->rx_xstats.rx_urb_unparked++;
+
+		mcba_usb_rx_resubmit(priv, urb);
+		usb_free_urb(urb);
+	}
+}
+
+/* Resubmit a consumed URB, or hold it back while the bus is idle */
+static void mcba_usb_rx_recycle(struct mcba_priv *priv, struct urb *urb)
+{
+	if (priv->rx_urbs_cnt - priv->rx_parked_cnt > MCBA_RX_IDLE_URBS &&
+	    mcba_usb_rx_idle(priv)) {
+		usb_anchor_urb(urb, &priv->rx_parked);
+		priv->rx_parked_cnt++;
+		priv->rx_xstats.rx_urb_parked++;
+		return;
+	}
+
+	mcba_usb_rx_resubmit(priv, urb);
+}
+
+static int mcba_usb_poll(struct napi_struct *napi, int budget)
+{
+	struct mcba_priv *priv = container_of(napi, struct mcba_priv, napi);
+	struct urb *urb;
+	int work_done = 0;
+	int i;
+
+	/* completions from here on are for the next poll */
+	atomic_set(&priv->rx_coal_cnt, 0);
+
+	/* URBs failing again are parked behind the ones still to try */
+	for (i = 0; i < priv->rx_urbs_cnt; i++) {
+		urb = usb_get_from_anchor(&priv->rx_failed);
+		if (!urb)
+			break;
+
+		mcba_usb_rx_resubmit(priv, urb);
+		usb_free_urb(urb);
+	}
+
+	/* Transfers are never split, take one only if all of it fits */
+	while (work_done + priv->rx_msg_max <= budget) {
+		struct mcba_usb_rx_urb *rx;
+
+		urb = usb_get_from_anchor(&priv->rx_done);
+		if (!urb)
+			break;
+
+		rx = urb->context;
+		priv->rx_done_ns = rx->done_ns;
+
+		work_done += mcba_usb_process_urb(priv, urb);
+
+		if (unlikely(priv->rx_parked_cnt) && !mcba_usb_rx_idle(priv))
+			mcba_usb_rx_unpark(priv);
+
+		mcba_usb_rx_recycle(priv, urb);
+
+		/* drop the reference taken by usb_get_from_anchor() */
+		usb_free_urb(urb);
+	}
+
+	if (unlikely(rcu_access_pointer(priv->cap)))
+		mcba_usb_cap_flush(priv);
+
+	if (work_done < budget) {
+		/* budget too small for the next transfer, keep polling */
+		if (!usb_anchor_empty(&priv->rx_done))
+			return budget;
+
+		napi_complete_done(napi, work_done);
+	}
+
+	return work_done;
+}
+
+/* Free RX URBs from keep on. They must not be in flight, see
+ * mcba_urb_unlink().
+ */
+static void mcba_usb_trim_rx_urbs(struct mcba_priv *priv, int keep)
+{
+	int i;
+
+	for (i = keep; i < priv->rx_urbs_cnt; i++) {
+		struct urb *urb = priv->rx_urbs[i].urb;
+
+		usb_free_coherent(priv->udev, priv->rx_buf_size,
+				  urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+
+		priv->rx_urbs[i].urb = NULL;
+	}
+
+	priv->rx_urbs_cnt = min(priv->rx_urbs_cnt, keep);
+}
+
+static void mcba_usb_free_rx_urbs(struct mcba_priv *priv)
+{
+	mcba_usb_trim_rx_urbs(priv, 0);
+}
+
+/* Top up the RX URBs to rx_ring_size, keeping the ones already there */
+static int mcba_usb_alloc_rx_urbs(struct mcba_priv *priv)
+{
+	while (priv->rx_urbs_cnt < priv->rx_ring_size) {
+		struct mcba_usb_rx_urb *rx = &priv->rx_urbs[priv->rx_urbs_cnt];
+		struct urb *urb;
 		u8 *buf;
 
-		/* create a URB, and a buffer for it */
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb) {
-			netdev_err(netdev, "No memory left for URBs\n");
-			err = -ENOMEM;
-			break;
-		}
+		/* create a URB, and a buffer for it */
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			netdev_err(priv->netdev, "No memory left for URBs\n");
+			priv->rx_xstats.urb_alloc_err++;
+			return -ENOMEM;
+		}
+
+		buf = usb_alloc_coherent(priv->udev, priv->rx_buf_size,
+					 GFP_KERNEL,
+					 &urb->transfer_dma);
+		if (!buf) {
+			netdev_err(priv->netdev,
+				   "No memory left for USB buffer\n");
+			priv->rx_xstats.urb_alloc_err++;
+			usb_free_urb(urb);
+			return -ENOMEM;
+		}
+
+		usb_fill_bulk_urb(urb, priv->udev,
+				  usb_rcvbulkpipe(priv->udev,
+						  MCBA_USB_EP_IN),
+				  buf, priv->rx_buf_size,
+				  mcba_usb_read_bulk_callback, rx);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		rx->priv = priv;
+		rx->urb = urb;
+		priv->rx_urbs_cnt++;
+	}
+
+	return 0;
+}
+
+/* Allocate TX URBs and their buffers once, so the xmit path never has to.
+ * URBs kept from the last open are reused, the ones beyond a shrunk ring
+ * are freed.
+ */
+static int mcba_usb_alloc_tx_urbs(struct mcba_priv *priv)
+{
+	int i;
+
+	BUILD_BUG_ON(MCBA_USB_TX_BATCH_SIZE > MCBA_USB_RX_BUFF_SIZE);
+
+	for (i = priv->tx_ring_size; i < MCBA_MAX_TX_URBS; i++) {
+		struct mcba_usb_ctx *ctx = &priv->tx_context[i];
+
+		if (!ctx->urb)
+			continue;
+
+		usb_free_coherent(priv->udev, MCBA_USB_TX_BATCH_SIZE,
+				  ctx->buf, ctx->urb->transfer_dma);
+		usb_free_urb(ctx->urb);
+
+		ctx->urb = NULL;
+		ctx->buf = NULL;
+	}
+
+	for (i = 0; i < priv->tx_ring_size; i++) {
+		struct mcba_usb_ctx *ctx = &priv->tx_context[i];
+
+		if (ctx->urb)
+			continue;
+
+		ctx->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ctx->urb) {
+			netdev_err(priv->netdev, "No memory left for URBs\n");
+			priv->rx_xstats.urb_alloc_err++;
+			goto nomem;
+		}
+
+		ctx->buf = usb_alloc_coherent(priv->udev,
+					      MCBA_USB_TX_BATCH_SIZE,
+					      GFP_KERNEL,
+					      &ctx->urb->transfer_dma);
+		if (!ctx->buf) {
+			netdev_err(priv->netdev,
+				   "No memory left for USB buffer\n");
+			priv->rx_xstats.urb_alloc_err++;
+			usb_free_urb(ctx->urb);
+			ctx->urb = NULL;
+			goto nomem;
+		}
+
+		usb_fill_bulk_urb(ctx->urb, priv->udev,
+				  usb_sndbulkpipe(priv->udev, MCBA_USB_EP_OUT),
+				  ctx->buf, MCBA_USB_TX_BATCH_SIZE,
+				  mcba_usb_write_bulk_callback, ctx);
+		ctx->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+
+	return 0;
+
+nomem:
+	/* whatever was allocated is reused next time or freed on disconnect */
+	return -ENOMEM;
+}
+
+/* TX URBs must not be in flight, kill tx_submitted anchor first */
+static void mcba_usb_free_tx_urbs(struct mcba_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < MCBA_MAX_TX_URBS; i++) {
+		struct mcba_usb_ctx *ctx = &priv->tx_context[i];
+
+		if (!ctx->urb)
+			continue;
+
+		usb_free_coherent(priv->udev, MCBA_USB_TX_BATCH_SIZE,
+				  ctx->buf, ctx->urb->transfer_dma);
+		usb_free_urb(ctx->urb);
+
+		ctx->urb = NULL;
+		ctx->buf = NULL;
+	}
+}
+
+/* Submit every allocated RX URB. Returns the number submitted, or the
+ * error if none was.
+ */
+static int mcba_usb_submit_rx_urbs(struct mcba_priv *priv, gfp_t gfp)
+{
+	int err = 0;
+	int i;
+
+	/* start at full depth, mcba_urb_unlink() dropped the parked ones */
+	priv->rx_parked_cnt = 0;
+	priv->rx_busy = jiffies;
+	atomic_set(&priv->rx_coal_cnt, 0);
+
+	for (i = 0; i < priv->rx_urbs_cnt; i++) {
+		struct urb *urb = priv->rx_urbs[i].urb;
+
+		priv->rx_urbs[i].done_ns = 0;
+		usb_anchor_urb(urb, &priv->rx_submitted);
+
+		err = mcba_usb_submit_urb(urb, gfp);
+		trace_mcba_usb_rx_submit(priv->netdev, urb, priv->rx_buf_size,
+					 err);
+		if (err) {
+			usb_unanchor_urb(urb);
+			break;
+		}
+	}
+
+	/* Keep our references, URBs are recycled by mcba_usb_poll(). The
+	 * ones that did not make it in are of no use.
+	 */
+	mcba_usb_trim_rx_urbs(priv, i);
+
+	return i ? i : err;
+}
+
+/* Start USB device */
+static int mcba_usb_start(struct mcba_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
+	unsigned int buf_size;
+	int err, i;
+
+	mcba_init_ctx(priv);
+	priv->ka_can_valid = false;
+
+	/* version known since probe, the keep alive after open confirms it */
+	mcba_usb_update_tx_batch(priv);
+
+	/* pick up the module parameter, it may have changed since last up */
+	buf_size = rounddown(rx_buf_size, MCBA_USB_RX_BUFF_SIZE);
+	buf_size = clamp_t(unsigned int, buf_size,
+			   MCBA_USB_RX_BUFF_SIZE, MCBA_USB_RX_BUFF_MAX);
+
+	/* RX URBs survive ifdown, unless their buffer or the ring changed */
+	if (buf_size != priv->rx_buf_size)
+		mcba_usb_free_rx_urbs(priv);
+	else
+		mcba_usb_trim_rx_urbs(priv, priv->rx_ring_size);
+
+	priv->rx_buf_size = buf_size;
+	/* a record carried over from the previous transfer may complete */
+	priv->rx_msg_max = (priv->rx_buf_size + MCBA_USB_TX_BUFF_SIZE - 1) /
+			   MCBA_USB_TX_BUFF_SIZE;
+	memset(&priv->rx_parser, 0, sizeof(priv->rx_parser));
+
+	/* ring size may have changed, at least one context stays shared */
+	priv->tx_bulk_size = priv->tx_ring_size -
+			     min(priv->tx_prio_slots, priv->tx_ring_size - 1);
+
+	/* tx_disable and loopback never hand a frame to the device */
+	if (priv->tx_disable || (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)) {
+		mcba_usb_free_tx_urbs(priv);
+	} else {
+		err = mcba_usb_alloc_tx_urbs(priv);
+		if (err)
+			return err;
+	}
+
+	/* a short ring still works, it is checked below */
+	err = mcba_usb_alloc_rx_urbs(priv);
+
+	i = mcba_usb_submit_rx_urbs(priv, GFP_KERNEL);
+
+	/* Did we submit any URBs */
+	if (i <= 0) {
+		netdev_warn(netdev, "couldn't setup read URBs\n");
+		return i ? i : err;
+	}
+
+	/* Warn if we've couldn't transmit all the URBs */
+	if (i < priv->rx_ring_size)
+		netdev_warn(netdev, "rx performance may be slow, %d of %u RX URBs submitted\n",
+			    priv->rx_urbs_cnt, priv->rx_ring_size);
+
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+
+	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_USB);
+	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_CAN);
+
+	/* running with fewer RX URBs than asked for is not an error */
+	return 0;
+}
+
+static inline void mcba_init_ctx(struct mcba_priv *priv)
+{
+	int i = 0;
+
+	BUILD_BUG_ON(MCBA_MAX_TX_URBS > U8_MAX + 1);
+
+	for (i = 0; i < MCBA_MAX_TX_URBS; i++) {
+		priv->tx_context[i].ndx = i;
+		priv->tx_context[i].dlc = 0;
+		priv->tx_context[i].batch_cnt = 0;
+	}
+
+	bitmap_zero(priv->tx_ctx_map, MCBA_MAX_TX_URBS);
+	memset(priv->tx_batch_ctx, 0, sizeof(priv->tx_batch_ctx));
+
+	priv->rsp_head = 0;
+	priv->rsp_tail = 0;
+	priv->rsp_seq = 0;
+}
+
+/* Contexts are taken from xmit and released from URB completion and from
+ * the RX path (echo_rsp), so ownership is decided by an atomic bit per ctx
+ * rather than by a lock.
+ */
+static inline struct mcba_usb_ctx *mcba_usb_get_free_ctx(struct mcba_priv *priv,
+							 unsigned int q)
+{
+	unsigned long ndx;
+
+	/* The priority queue tries its reserved contexts (from tx_bulk_size
+	 * up) first, the bulk queue never sees them.
+	 */
+	do {
+		ndx = priv->tx_ring_size;
+		if (q == MCBA_TXQ_PRIO)
+			ndx = find_next_zero_bit(priv->tx_ctx_map,
+						 priv->tx_ring_size,
+						 priv->tx_bulk_size);
+
+		if (ndx >= priv->tx_ring_size) {
+			ndx = find_first_zero_bit(priv->tx_ctx_map,
+						  priv->tx_bulk_size);
+			if (ndx >= priv->tx_bulk_size)
+				return NULL;
+		}
+	} while (test_and_set_bit_lock(ndx, priv->tx_ctx_map));
+
+	atomic_set(&priv->tx_context[ndx].refs, 1);
+
+	return &priv->tx_context[ndx];
+}
+
+/* Contexts queue q could take right now */
+static inline unsigned int mcba_usb_free_ctx_cnt(struct mcba_priv *priv,
+						 unsigned int q)
+{
+	unsigned int size = q == MCBA_TXQ_PRIO ? priv->tx_ring_size :
+						 priv->tx_bulk_size;
+
+	return size - bitmap_weight(priv->tx_ctx_map, size);
+}
+
+/* Wake stopped queues with some hysteresis, instead of on every freed ctx.
+ * The priority queue is woken as soon as it can send again.
+ */
+static void mcba_usb_tx_wake(struct mcba_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
+	unsigned int thresh;
+	unsigned int free;
+	unsigned int q;
+
+	for (q = 0; q < netdev->real_num_tx_queues; q++) {
+		struct netdev_queue *txq = netdev_get_tx_queue(netdev, q);
+
+		if (!netif_tx_queue_stopped(txq))
+			continue;
+
+		thresh = q == MCBA_TXQ_PRIO ? 1 : MCBA_TX_WAKE_THRESH(priv);
+		free = mcba_usb_free_ctx_cnt(priv, q);
+		if (free >= thresh) {
+			trace_mcba_usb_queue_wake(netdev, free);
+			netif_tx_wake_queue(txq);
+		}
+	}
+}
+
+/* URB context is the ctx, it finds its mcba_priv by its index */
+static inline struct mcba_priv *mcba_usb_ctx_priv(struct mcba_usb_ctx *ctx)
+{
+	return container_of(ctx - ctx->ndx, struct mcba_priv, tx_context[0]);
+}
+
+static inline void mcba_usb_free_ctx(struct mcba_priv *priv,
+				     struct mcba_usb_ctx *ctx)
+{
+	ctx->dlc = 0;
+	ctx->len = 0;
+	ctx->rsp = false;
+	ctx->batch_cnt = 0;
+
+	clear_bit_unlock(ctx->ndx, priv->tx_ctx_map);
+}
+
+static inline void mcba_usb_put_ctx(struct mcba_priv *priv,
+				    struct mcba_usb_ctx *ctx)
+{
+	if (atomic_dec_and_test(&ctx->refs))
+		mcba_usb_free_ctx(priv, ctx);
+}
+
+/* A failed TX URB gets no TRANSMIT_MESSAGE_RSP for its frames. Take the
+ * ones still waiting out of the FIFO, so later responses are matched to the
+ * right frames, and drop them like mcba_usb_tx_drop() does.
+ */
+static void mcba_usb_tx_rsp_cancel(struct mcba_priv *priv,
+				   struct mcba_usb_ctx *ctx)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->netdev, ctx->txq);
+	u8 ndx[MCBA_TX_BATCH_MAX];
+	unsigned long flags;
+	unsigned int from;
+	unsigned int to;
+	int cnt = 0;
+	int i;
+
+	spin_lock_irqsave(&priv->rsp_lock, flags);
+
+	for (from = to = priv->rsp_head; from != priv->rsp_tail; from++) {
+		u8 n = priv->rsp_fifo[from % MCBA_MAX_TX_URBS];
+
+		/* After a partial transfer, leading frames may be answered
+		 * and their contexts reused by a newer batch. Only the
+		 * sequence numbers tell our frames apart.
+		 */
+		if (priv->tx_context[n].rsp_seq - ctx->rsp_seq < ctx->batch_cnt)
+			ndx[cnt++] = n;
+		else
+			priv->rsp_fifo[to++ % MCBA_MAX_TX_URBS] = n;
+	}
+	priv->rsp_tail = to;
+
+	spin_unlock_irqrestore(&priv->rsp_lock, flags);
+
+	/* the response references, the URB one is put by the caller */
+	for (i = 0; i < cnt; i++) {
+		struct mcba_usb_ctx *msg_ctx = &priv->tx_context[ndx[i]];
+
+		can_free_echo_skb(priv->netdev, msg_ctx->ndx);
+		netdev_tx_completed_queue(txq, 1, msg_ctx->len);
+		priv->netdev->stats.tx_dropped++;
+
+		mcba_usb_put_ctx(priv, msg_ctx);
+	}
+}
+
+static void mcba_usb_write_bulk_callback(struct urb *urb)
+{
+	struct mcba_usb_ctx *ctx = urb->context;
+	struct mcba_priv *priv = mcba_usb_ctx_priv(ctx);
+	struct net_device *netdev = priv->netdev;
+	unsigned int pkts = 0;
+	unsigned int bytes = 0;
+	int i;
+
+	mcba_usb_fault_complete(urb);
+
+	trace_mcba_usb_tx_complete(netdev, urb, urb->actual_length,
+				   urb->status);
+
+	if (!netif_device_present(netdev))
+		return;
+
+	/* the URB went out with the oldest frame of its batch */
+	mcba_usb_lat_add(&priv->tx_lat, ctx->xmit_ns);
+
+	/* With echo_rsp, frames are completed by mcba_usb_process_tx_rsp()
+	 * and may already be gone, only the URB reference is ours.
+	 */
+	for (i = 0; !ctx->rsp && i < ctx->batch_cnt; i++) {
+		struct mcba_usb_ctx *msg_ctx =
+			&priv->tx_context[ctx->batch_ndx[i]];
+
+		mcba_usb_stats_tx(priv, msg_ctx->dlc);
+		mcba_usb_load_add(&priv->tx_load, msg_ctx->bits);
+		pkts++;
+		bytes += msg_ctx->len;
+
+		trace_mcba_usb_echo(netdev, msg_ctx->ndx);
+		can_get_echo_skb(netdev, msg_ctx->ndx);
+
+		/* the ctx owning the URB is released last */
+		if (msg_ctx != ctx)
+			mcba_usb_put_ctx(priv, msg_ctx);
+	}
+
+	if (urb->status) {
+		netdev_info(netdev, "Tx URB aborted (%d)\n",
+			    urb->status);
+
+		if (ctx->rsp)
+			mcba_usb_tx_rsp_cancel(priv, ctx);
+	}
+
+	/* a batch never mixes queues */
+	netdev_tx_completed_queue(netdev_get_tx_queue(netdev, ctx->txq), pkts,
+				  bytes);
+
+	/* Release context, its URB and buffer stay allocated for reuse.
+	 * Wake only after the slot is free, otherwise xmit may see the queue
+	 * running with no slot and stop it for good.
+	 */
+	mcba_usb_put_ctx(priv, ctx);
+
+	mcba_usb_tx_wake(priv);
+}
+
+/* Frames with a high skb priority (SO_PRIORITY) or a base ID below
+ * tx_prio_id take the priority queue. The base ID is what wins arbitration,
+ * so EFF frames are compared by their upper 11 bits.
+ */
+static u16 mcba_usb_select_queue(struct net_device *netdev,
+				 struct sk_buff *skb,
+				 struct net_device *sb_dev)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	canid_t id;
+
+	if (netdev->real_num_tx_queues == 1)
+		return MCBA_TXQ_BULK;
+
+	if (skb->priority >= TC_PRIO_INTERACTIVE)
+		return MCBA_TXQ_PRIO;
+
+	if (cf->can_id & CAN_EFF_FLAG)
+		id = (cf->can_id & CAN_EFF_MASK) >>
+		     (CAN_EFF_ID_BITS - CAN_SFF_ID_BITS);
+	else
+		id = cf->can_id & CAN_SFF_MASK;
+
+	return id < READ_ONCE(priv->tx_prio_id) ? MCBA_TXQ_PRIO : MCBA_TXQ_BULK;
+}
+
+/* The firmware has no loopback mode. Frames are turned around here, so
+ * they never reach the bus and never need a TX URB.
+ */
+static netdev_tx_t mcba_usb_loopback_xmit(struct mcba_priv *priv,
+					  struct sk_buff *skb)
+{
+	struct net_device *netdev = priv->netdev;
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	unsigned int q = skb_get_queue_mapping(skb);
+	struct sk_buff *rx_skb;
+	struct can_frame *rx_cf;
+	u8 dlc = cf->can_dlc;
+
+	/* The looped back copy is received like any other frame. Its
+	 * counters stay on the TX side, the RX ones belong to poll.
+	 */
+	if (!mcba_usb_rx_accept(priv, cf->can_id)) {
+		priv->tx_xstats.lb_filtered++;
+	} else {
+		rx_skb = mcba_usb_alloc_can_skb(netdev, &rx_cf);
+		if (rx_skb) {
+			memcpy(rx_cf, cf, sizeof(*rx_cf));
+			mcba_usb_stats_rx(priv, dlc);
+			netif_rx(rx_skb);
+		} else {
+			netdev->stats.rx_dropped++;
+			priv->tx_xstats.lb_alloc_err++;
+		}
+	}
+
+	/* xmit is serialized per queue, so one echo slot each is enough */
+	mcba_usb_stats_tx(priv, dlc);
+	can_put_echo_skb(skb, netdev, q);
+	can_get_echo_skb(netdev, q);
+
+	return NETDEV_TX_OK;
+}
+
+/* Send data to device */
+static netdev_tx_t mcba_usb_start_xmit(struct sk_buff *skb,
+				       struct net_device *netdev)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	struct mcba_usb_msg_can usb_msg;
+
+	trace_mcba_usb_xmit(netdev, cf->can_id, cf->can_dlc);
+
+	/* loopback wins over tx_disable, the frame stays off the bus */
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
+		return mcba_usb_loopback_xmit(priv, skb);
+
+	/* no TX URBs with tx_disable, see mcba_usb_start() */
+	if (unlikely(priv->tx_disable)) {
+		netdev->stats.tx_dropped++;
+		dev_kfree_skb(skb);
+
+		return NETDEV_TX_OK;
+	}
+
+	mcba_usb_encode_can(&usb_msg, cf->can_id, cf->can_dlc, cf->data);
+
+	return mcba_usb_xmit(priv, (struct mcba_usb_msg *)&usb_msg, skb);
+}
+
+/* Drop every message carried by a TX URB that could not be submitted */
+static void mcba_usb_tx_drop(struct mcba_priv *priv, struct mcba_usb_ctx *ctx)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->netdev, ctx->txq);
+	int i;
+
+	for (i = 0; i < ctx->batch_cnt; i++) {
+		struct mcba_usb_ctx *msg_ctx =
+			&priv->tx_context[ctx->batch_ndx[i]];
+
+		/* echo skb owns the frame, freeing it releases the skb */
+		can_free_echo_skb(priv->netdev, msg_ctx->ndx);
+		netdev_tx_completed_queue(txq, 1, msg_ctx->len);
+		priv->netdev->stats.tx_dropped++;
+
+		if (msg_ctx != ctx)
+			mcba_usb_free_ctx(priv, msg_ctx);
+	}
+
+	mcba_usb_free_ctx(priv, ctx);
+}
+
+static void mcba_usb_tx_submit(struct mcba_priv *priv, struct mcba_usb_ctx *ctx)
+{
+	unsigned long flags;
+	int err;
+
+	ctx->urb->transfer_buffer_length = ctx->batch_cnt *
+					   MCBA_USB_TX_BUFF_SIZE;
+
+	/* Responses come back in the order URBs reach the device. TX queues
+	 * submit concurrently, so the FIFO is filled and the URB submitted
+	 * under one lock.
+	 */
+	if (ctx->rsp) {
+		int i;
+
+		/* URB reference on top of the response one */
+		atomic_inc(&ctx->refs);
+
+		spin_lock_irqsave(&priv->rsp_lock, flags);
+		for (i = 0; i < ctx->batch_cnt; i++) {
+			u8 ndx = ctx->batch_ndx[i];
+
+			/* the owner is batch_ndx[0], its number is the base */
+			priv->tx_context[ndx].rsp_seq = priv->rsp_seq++;
+			priv->rsp_fifo[priv->rsp_tail++ % MCBA_MAX_TX_URBS] =
+				ndx;
+		}
+	}
+
+	usb_anchor_urb(ctx->urb, &priv->tx_submitted);
+
+	err = mcba_usb_submit_urb(ctx->urb, GFP_ATOMIC);
+	trace_mcba_usb_tx_submit(priv->netdev, ctx->urb,
+				 ctx->urb->transfer_buffer_length, err);
+
+	if (ctx->rsp) {
+		/* nothing will answer, take the frames back */
+		if (unlikely(err))
+			priv->rsp_tail -= ctx->batch_cnt;
+		spin_unlock_irqrestore(&priv->rsp_lock, flags);
+	}
+
+	if (likely(!err))
+		return;
+
+	usb_unanchor_urb(ctx->urb);
+	priv->tx_xstats.tx_submit_err++;
+
+	if (err == -ENODEV)
+		netif_device_detach(priv->netdev);
+	else
+		netdev_warn(priv->netdev, "failed tx_urb %d\n", err);
+
+	mcba_usb_tx_drop(priv, ctx);
+}
+
+/* Submit the partially filled batch of a queue, if any. xmit path only. */
+static void mcba_usb_tx_batch_flush(struct mcba_priv *priv, unsigned int q)
+{
+	struct mcba_usb_ctx *ctx = priv->tx_batch_ctx[q];
+
+	if (!ctx)
+		return;
+
+	priv->tx_batch_ctx[q] = NULL;
+	mcba_usb_tx_submit(priv, ctx);
+}
+
+/* Send data to device */
+static netdev_tx_t mcba_usb_xmit(struct mcba_priv *priv,
+				 struct mcba_usb_msg *usb_msg,
+				 struct sk_buff *skb)
+{
+	struct mcba_usb_msg_can *msg = (struct mcba_usb_msg_can *)usb_msg;
+	unsigned int q = skb_get_queue_mapping(skb);
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->netdev, q);
+	struct mcba_usb_ctx *ctx = 0;
+	struct mcba_usb_ctx *urb_ctx;
+	bool flush;
+
+	if (mcba_usb_should_fail(alloc, sizeof(*ctx)))
+		ctx = NULL;
+	else
+		ctx = mcba_usb_get_free_ctx(priv, q);
+	if (!ctx) {
+		priv->tx_xstats.tx_busy++;
+
+		/* Don't sit on frames while the queue is stopped */
+		mcba_usb_tx_batch_flush(priv, q);
+
+		/* Slow down tx path */
+		netif_tx_stop_queue(txq);
+		trace_mcba_usb_queue_stop(priv->netdev,
+					  mcba_usb_free_ctx_cnt(priv, q));
+
+		/* Completions may have freed slots before the queue stopped */
+		mcba_usb_tx_wake(priv);
+
+		return NETDEV_TX_BUSY;
+	}
+
+	ctx->dlc = msg->dlc & MCBA_DLC_MASK;
+	ctx->bits = mcba_usb_msg_bits(msg);
+	ctx->len = DIV_ROUND_UP(ctx->bits, 8);
+	can_put_echo_skb(skb, priv->netdev, ctx->ndx);
+	ctx->txq = q;
+	ctx->rsp = priv->echo_rsp;
+	ctx->xmit_ns = mcba_usb_lat_start();
+
+	/* CAN frames are stacked into the URB of the first frame of a batch,
+	 * the same way the device stacks messages in RX transfers. The batch
+	 * is flushed when it is full or when the stack has no more frames
+	 * queued for us.
+	 */
+	if (priv->tx_batch_ok || priv->tx_batch_ctx[q]) {
+		if (!priv->tx_batch_ctx[q])
+			priv->tx_batch_ctx[q] = ctx;
+
+		urb_ctx = priv->tx_batch_ctx[q];
+	} else {
+		urb_ctx = ctx;
+	}
+
+	/* URB and buffer come preallocated with the context */
+	memcpy(urb_ctx->buf + urb_ctx->batch_cnt * MCBA_USB_TX_BUFF_SIZE,
+	       usb_msg, MCBA_USB_TX_BUFF_SIZE);
+	urb_ctx->batch_ndx[urb_ctx->batch_cnt++] = ctx->ndx;
+
+	/* BQL may stop the queue here, which must flush the batch too */
+	flush = __netdev_tx_sent_queue(txq, ctx->len, netdev_xmit_more());
+
+	if (urb_ctx == priv->tx_batch_ctx[q]) {
+		if (urb_ctx->batch_cnt < MCBA_TX_BATCH_MAX && !flush)
+			return NETDEV_TX_OK;
+
+		priv->tx_batch_ctx[q] = NULL;
+	}
+
+	mcba_usb_tx_submit(priv, urb_ctx);
+
+	return NETDEV_TX_OK;
+}
+
+/* Record the outcome of a command ticket. cmd.lock held. */
+static void mcba_usb_cmd_done(struct mcba_priv *priv, int slot,
+			      unsigned int ticket, int status)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+
+	/* killed URBs are no news, the device is going away */
+	if (status && status != -ENOENT && status != -ESHUTDOWN) {
+		priv->tx_xstats.cmd_err++;
+		netdev_warn(priv->netdev, "command %02x failed (%d)\n",
+			    cmd->msg[slot][0], status);
+	}
+
+	cmd->done[slot] = ticket;
+	cmd->status[slot] = status;
+}
+
+/* Hand the next pending command to the URB if it is idle. cmd.lock held. */
+static void mcba_usb_cmd_kick(struct mcba_priv *priv)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	int slot;
+	int err;
+
+	while (cmd->alive && !cmd->suspended && cmd->busy < 0 && cmd->pending) {
+		slot = __ffs(cmd->pending);
+		__clear_bit(slot, &cmd->pending);
+
+		memcpy(cmd->buf, cmd->msg[slot], MCBA_USB_MSG_SIZE);
+		cmd->busy = slot;
+		cmd->busy_ticket = cmd->queued[slot];
+
+		err = mcba_usb_submit_urb(cmd->urb, GFP_ATOMIC);
+		trace_mcba_usb_tx_submit(priv->netdev, cmd->urb,
+					 MCBA_USB_MSG_SIZE, err);
+		if (likely(!err))
+			return;
+
+		if (err == -ENODEV)
+			netif_device_detach(priv->netdev);
+
+		cmd->busy = -1;
+		mcba_usb_cmd_done(priv, slot, cmd->busy_ticket, err);
+	}
+}
+
+static void mcba_usb_cmd_callback(struct urb *urb)
+{
+	struct mcba_priv *priv = urb->context;
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	unsigned long flags;
+
+	mcba_usb_fault_complete(urb);
+
+	trace_mcba_usb_tx_complete(priv->netdev, urb, urb->actual_length,
+				   urb->status);
+
+	spin_lock_irqsave(&cmd->lock, flags);
+
+	/* killed by suspend, the slot is sent again on resume */
+	if (cmd->suspended && urb->status == -ENOENT)
+		__set_bit(cmd->busy, &cmd->pending);
+	else
+		mcba_usb_cmd_done(priv, cmd->busy, cmd->busy_ticket,
+				  urb->status);
+	cmd->busy = -1;
+	mcba_usb_cmd_kick(priv);
+
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	wake_up_all(&cmd->wait);
+}
+
+static bool mcba_usb_cmd_completed(struct mcba_usb_cmd_chan *cmd, int slot,
+				   unsigned int ticket)
+{
+	return (int)(READ_ONCE(cmd->done[slot]) - ticket) >= 0;
+}
+
+/* Queue a command, replacing one still pending in the same slot. Never
+ * competes with CAN frames for TX contexts. The ticket is for
+ * mcba_usb_cmd_wait().
+ */
+static int mcba_usb_cmd_queue(struct mcba_priv *priv, int slot,
+			      const void *usb_msg, unsigned int *ticket)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cmd->lock, flags);
+
+	if (!cmd->alive) {
+		spin_unlock_irqrestore(&cmd->lock, flags);
+		return -ENODEV;
+	}
+
+	if (__test_and_set_bit(slot, &cmd->pending))
+		priv->tx_xstats.cmd_coalesced++;
+
+	memcpy(cmd->msg[slot], usb_msg, MCBA_USB_MSG_SIZE);
+	*ticket = ++cmd->queued[slot];
+	mcba_usb_cmd_kick(priv);
+
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	return 0;
+}
+
+/* Sleep until the device took the command (or a later one for the same
+ * slot), returns the URB status
+ */
+static int mcba_usb_cmd_wait(struct mcba_priv *priv, int slot,
+			     unsigned int ticket)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+
+	if (!wait_event_timeout(cmd->wait,
+				mcba_usb_cmd_completed(cmd, slot, ticket),
+				MCBA_CMD_TIMEOUT))
+		return -ETIMEDOUT;
+
+	return READ_ONCE(cmd->status[slot]);
+}
+
+static int mcba_usb_cmd_send(struct mcba_priv *priv, int slot,
+			     const void *usb_msg, bool wait)
+{
+	unsigned int ticket;
+	int ret;
+
+	ret = mcba_usb_cmd_queue(priv, slot, usb_msg, &ticket);
+	if (ret || !wait)
+		return ret;
+
+	return mcba_usb_cmd_wait(priv, slot, ticket);
+}
+
+static int mcba_usb_cmd_init(struct mcba_priv *priv)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+
+	BUILD_BUG_ON(MCBA_CMD_SLOTS > BITS_PER_LONG);
+
+	spin_lock_init(&cmd->lock);
+	init_waitqueue_head(&cmd->wait);
+	cmd->busy = -1;
+
+	cmd->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!cmd->urb)
+		return -ENOMEM;
+
+	cmd->buf = usb_alloc_coherent(priv->udev, MCBA_USB_MSG_SIZE,
+				      GFP_KERNEL, &cmd->urb->transfer_dma);
+	if (!cmd->buf) {
+		usb_free_urb(cmd->urb);
+		return -ENOMEM;
+	}
+
+	usb_fill_bulk_urb(cmd->urb, priv->udev,
+			  usb_sndbulkpipe(priv->udev, MCBA_USB_EP_OUT),
+			  cmd->buf, MCBA_USB_MSG_SIZE,
+			  mcba_usb_cmd_callback, priv);
+	cmd->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	cmd->alive = true;
+
+	return 0;
+}
+
+/* Hold commands back while the device sleeps. Waiters keep waiting, the
+ * command in flight is requeued by mcba_usb_cmd_callback().
+ */
+static void mcba_usb_cmd_suspend(struct mcba_priv *priv)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cmd->lock, flags);
+	cmd->suspended = true;
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	usb_kill_urb(cmd->urb);
+}
+
+static void mcba_usb_cmd_resume(struct mcba_priv *priv)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cmd->lock, flags);
+	cmd->suspended = false;
+	mcba_usb_cmd_kick(priv);
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	/* a failed kick completes tickets */
+	wake_up_all(&cmd->wait);
+}
+
+/* Stop the channel for good and fail whatever is still waiting */
+static void mcba_usb_cmd_release(struct mcba_priv *priv)
+{
+	struct mcba_usb_cmd_chan *cmd = &priv->cmd;
+	unsigned long flags;
+	int slot;
+
+	spin_lock_irqsave(&cmd->lock, flags);
+	cmd->alive = false;
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	usb_kill_urb(cmd->urb);
+
+	spin_lock_irqsave(&cmd->lock, flags);
+	for (slot = 0; slot < MCBA_CMD_SLOTS; slot++) {
+		cmd->done[slot] = cmd->queued[slot];
+		if (test_bit(slot, &cmd->pending))
+			cmd->status[slot] = -ENODEV;
+	}
+	cmd->pending = 0;
+	spin_unlock_irqrestore(&cmd->lock, flags);
+
+	wake_up_all(&cmd->wait);
+
+	usb_free_coherent(priv->udev, MCBA_USB_MSG_SIZE, cmd->buf,
+			  cmd->urb->transfer_dma);
+	usb_free_urb(cmd->urb);
+}
+
+/* Doesn't sleep, wait on the ticket for the outcome */
+static int mcba_usb_queue_change_bitrate(struct mcba_priv *priv, u16 bitrate,
+					 unsigned int *ticket)
+{
+	struct mcba_usb_msg_change_bitrate usb_msg;
+
+	usb_msg.cmd_id =  MBCA_CMD_CHANGE_BIT_RATE;
+	usb_msg.bitrate_hi = (0xff00 & bitrate) >> 8;
+	usb_msg.bitrate_lo = (0xff & bitrate);
+
+	return mcba_usb_cmd_queue(priv, MCBA_CMD_SLOT_BITRATE, &usb_msg,
+				  ticket);
+}
+
+/* Process context only, waits for the device */
+static int mcba_usb_xmit_change_bitrate(struct mcba_priv *priv, u16 bitrate)
+{
+	unsigned int ticket;
+	int ret;
+
+	ret = mcba_usb_queue_change_bitrate(priv, bitrate, &ticket);
+	if (ret)
+		return ret;
 
-		buf = usb_alloc_coherent(priv->udev, MCBA_USB_RX_BUFF_SIZE,
-					 GFP_KERNEL,
-					 &urb->transfer_dma);
-		if (!buf) {
-			netdev_err(netdev, "No memory left for USB buffer\n");
-			usb_free_urb(urb);
-			err = -ENOMEM;
+	return mcba_usb_cmd_wait(priv, MCBA_CMD_SLOT_BITRATE, ticket);
+}
+
+/* The answer comes back as READ_FW_VERSION_RSP on the RX path */
+static void mcba_usb_xmit_read_fw_ver(struct mcba_priv *priv, u8 pic)
+{
+	struct mcba_usb_msg_fw_ver usb_msg;
+	int slot = pic == MCBA_VER_REQ_USB ? MCBA_CMD_SLOT_FW_VER_USB :
+					     MCBA_CMD_SLOT_FW_VER_CAN;
+
+	usb_msg.cmd_id = MBCA_CMD_READ_FW_VERSION;
+	usb_msg.pic = pic;
+
+	mcba_usb_cmd_send(priv, slot, &usb_msg, false);
+}
+
+/* Process context only, waits for the device */
+static int mcba_usb_xmit_termination(struct mcba_priv *priv, u8 termination)
+{
+	struct mcba_usb_msg_terminaton usb_msg;
+
+	usb_msg.cmd_id = MBCA_CMD_SETUP_TERMINATION_RESISTANCE;
+	usb_msg.termination = termination;
+
+	return mcba_usb_cmd_send(priv, MCBA_CMD_SLOT_TERMINATION, &usb_msg,
+				 true);
+}
+
+static void mcba_usb_info_rx(struct mcba_priv *priv, struct mcba_usb_msg *msg)
+{
+	struct mcba_usb_msg_ka_can *ka_can;
+
+	switch (msg->cmd_id) {
+	case MBCA_CMD_I_AM_ALIVE_FROM_USB:
+		mcba_usb_process_ka_usb(priv,
+					(struct mcba_usb_msg_ka_usb *)msg);
+		break;
+
+	case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
+		/* error state only matters once the interface is up */
+		ka_can = (struct mcba_usb_msg_ka_can *)msg;
+		WRITE_ONCE(priv->fw_ver_can,
+			   MCBA_FW_VER(ka_can->soft_ver_major,
+				       ka_can->soft_ver_minor));
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Query firmware versions and termination once after probe, so they are
+ * in sysfs before the interface was ever up. The keep alive replies are
+ * read with one-off transfers, RX URBs only exist while the interface is
+ * up and mcba_usb_open() waits for this to finish.
+ */
+static void mcba_usb_info_work(struct work_struct *work)
+{
+	struct mcba_priv *priv = container_of(work, struct mcba_priv,
+					      info_work);
+	unsigned int reads;
+	u8 *buf;
+	int len, i;
+	int err;
+
+	buf = kmalloc(MCBA_USB_RX_BUFF_SIZE, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	err = usb_autopm_get_interface(priv->intf);
+	if (err)
+		goto out_free;
+
+	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_USB);
+	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_CAN);
+
+	for (reads = 0; reads < MCBA_INFO_READS; reads++) {
+		/* open waits for us, RX URBs read the rest */
+		if (netif_running(priv->netdev))
 			break;
-		}
 
-		usb_fill_bulk_urb(urb, priv->udev,
-				  usb_rcvbulkpipe(priv->udev,
-						  MCBA_USB_EP_IN),
-				  buf, MCBA_USB_RX_BUFF_SIZE,
-				  mcba_usb_read_bulk_callback, priv);
-		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-		usb_anchor_urb(urb, &priv->rx_submitted);
+		if (priv->fw_ver_usb && priv->fw_ver_can)
+			break;
 
-		err = usb_submit_urb(urb, GFP_KERNEL);
-		if (err) {
-			usb_unanchor_urb(urb);
-			usb_free_coherent(priv->udev, MCBA_USB_RX_BUFF_SIZE,
-					  buf, urb->transfer_dma);
-			usb_free_urb(urb);
+		err = usb_bulk_msg(priv->udev,
+				   usb_rcvbulkpipe(priv->udev, MCBA_USB_EP_IN),
+				   buf, MCBA_USB_RX_BUFF_SIZE, &len,
+				   MCBA_INFO_TIMEOUT_MS);
+		if (err == -ETIMEDOUT)
+			continue;
+		if (err)
 			break;
-		}
 
-		/* Drop reference, USB core will take care of freeing it */
-		usb_free_urb(urb);
+		/* a record split across transfers is simply missed */
+		for (i = 0; i + MCBA_USB_MSG_SIZE <= len;
+		     i += MCBA_USB_MSG_SIZE)
+			mcba_usb_info_rx(priv, (struct mcba_usb_msg *)(buf + i));
 	}
 
-	/* Did we submit any URBs */
-	if (i == 0) {
-		netdev_warn(netdev, "couldn't setup read URBs\n");
+	if (err && err != -ETIMEDOUT && err != -ENODEV)
+		netdev_warn(priv->netdev, "firmware version query failed: %d\n",
+			    err);
+
+	usb_autopm_put_interface(priv->intf);
+
+out_free:
+	kfree(buf);
+}
+
+/* Open USB device */
+static int mcba_usb_open(struct net_device *netdev)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+	unsigned int i;
+	int err;
+
+	/* The version query reads from the RX endpoint, it must be done
+	 * before RX URBs are submitted. mcba_usb_start() asks again.
+	 */
+	cancel_work_sync(&priv->info_work);
+
+	/* the device stays awake, RX URBs are always queued while up */
+	err = usb_autopm_get_interface(priv->intf);
+	if (err)
 		return err;
+
+	/* common open */
+	err = open_candev(netdev);
+	if (err)
+		goto err_pm;
+
+	/* URBs are allocated here, so ring sizes set while down take effect */
+	napi_enable(&priv->napi);
+
+	err = mcba_usb_start(priv);
+	if (err) {
+		if (err == -ENODEV)
+			netif_device_detach(netdev);
+
+		netdev_warn(netdev, "couldn't start device: %d\n", err);
+
+		napi_disable(&priv->napi);
+		close_candev(netdev);
+
+		goto err_pm;
 	}
 
-	/* Warn if we've couldn't transmit all the URBs */
-	if (i < MCBA_MAX_RX_URBS)
-		netdev_warn(netdev, "rx performance may be slow\n");
+	/* bitrate set while the interface was down */
+	err = mcba_usb_xmit_change_bitrate(priv, priv->bitrate_kbps);
+	if (err) {
+		netdev_warn(netdev, "couldn't set bitrate: %d\n", err);
 
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+		mcba_usb_stop(priv);
+		close_candev(netdev);
 
-	mcba_init_ctx(priv);
-	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_USB);
-	mcba_usb_xmit_read_fw_ver(priv, MCBA_VER_REQ_CAN);
+		goto err_pm;
+	}
+
+	can_led_event(netdev, CAN_LED_EVENT_OPEN);
+
+	mcba_usb_load_start(priv);
+
+	for (i = 0; i < netdev->real_num_tx_queues; i++)
+		netdev_tx_reset_queue(netdev_get_tx_queue(netdev, i));
+	netif_tx_start_all_queues(netdev);
+
+	return 0;
+
+err_pm:
+	usb_autopm_put_interface(priv->intf);
 
 	return err;
 }
 
-static inline void mcba_init_ctx(struct mcba_priv *priv)
+/* NAPI must be disabled, otherwise poll may resubmit RX URBs behind us */
+static void mcba_urb_unlink(struct mcba_priv *priv)
+{
+	usb_kill_anchored_urbs(&priv->rx_submitted);
+	usb_kill_anchored_urbs(&priv->tx_submitted);
+
+	/* completed URBs are idle, they only need to leave the anchor */
+	usb_scuttle_anchored_urbs(&priv->rx_done);
+	usb_scuttle_anchored_urbs(&priv->rx_failed);
+	usb_scuttle_anchored_urbs(&priv->rx_parked);
+}
+
+/* Undo mcba_usb_start(), with NAPI still enabled */
+static void mcba_usb_stop(struct mcba_priv *priv)
+{
+	/* Stop polling */
+	napi_disable(&priv->napi);
+	mcba_urb_unlink(priv);
+
+	/* no URB left to requeue it */
+	hrtimer_cancel(&priv->rx_coal_timer);
+	cancel_work_sync(&priv->rx_work);
+
+	del_timer_sync(&priv->load.timer);
+	del_timer_sync(&priv->rx_retry);
+
+	/* URBs and buffers stay allocated for the next open */
+}
+
+/* Close USB device */
+static int mcba_usb_close(struct net_device *netdev)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	priv->can.state = CAN_STATE_STOPPED;
+
+	netif_tx_stop_all_queues(netdev);
+
+	mcba_usb_stop(priv);
+
+	close_candev(netdev);
+
+	can_led_event(netdev, CAN_LED_EVENT_STOP);
+
+	/* nothing is queued anymore, let it autosuspend */
+	usb_autopm_put_interface(priv->intf);
+
+	return 0;
+}
+
+/* Set network device mode
+ *
+ * Only CAN_MODE_START is supported, which is how candev restarts the
+ * controller after bus-off (manually or after restart-ms).
+ */
+static int mcba_net_set_mode(struct net_device *netdev, enum can_mode mode)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+	int err;
+
+	switch (mode) {
+	case CAN_MODE_START:
+		/* a bitrate change re-initializes the CAN controller */
+		err = mcba_usb_xmit_change_bitrate(priv, priv->bitrate_kbps);
+		if (err)
+			return err;
+
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+		netif_tx_wake_all_queues(netdev);
+
+		return 0;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int mcba_net_get_berr_counter(const struct net_device *netdev,
+				     struct can_berr_counter *bec)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	bec->txerr = priv->bec.txerr;
+	bec->rxerr = priv->bec.rxerr;
+
+	return 0;
+}
+
+static int mcba_usb_hwtstamp_set(struct net_device *netdev, struct ifreq *ifr)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+	struct hwtstamp_config cfg;
+
+	if (copy_from_user(&cfg, ifr->ifr_data, sizeof(cfg)))
+		return -EFAULT;
+
+	/* reserved for future extensions */
+	if (cfg.flags)
+		return -EINVAL;
+
+	/* TX timestamps come with the transmission response only */
+	if (cfg.tx_type != HWTSTAMP_TX_OFF &&
+	    !(cfg.tx_type == HWTSTAMP_TX_ON && priv->echo_rsp))
+		return -ERANGE;
+
+	if (cfg.rx_filter != HWTSTAMP_FILTER_NONE) {
+		/* all messages carry a timestamp */
+		cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+		mcba_usb_ts_resync(priv);
+	}
+
+	priv->hwts_cfg = cfg;
+
+	return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+}
+
+static int mcba_usb_hwtstamp_get(struct net_device *netdev, struct ifreq *ifr)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	return copy_to_user(ifr->ifr_data, &priv->hwts_cfg,
+			    sizeof(priv->hwts_cfg)) ? -EFAULT : 0;
+}
+
+static int mcba_usb_ioctl(struct net_device *netdev, struct ifreq *ifr, int cmd)
+{
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return mcba_usb_hwtstamp_set(netdev, ifr);
+
+	case SIOCGHWTSTAMP:
+		return mcba_usb_hwtstamp_get(netdev, ifr);
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void mcba_usb_sum_stats(struct mcba_usb_pcpu_stats __percpu *pcpu,
+			       u64 *packets, u64 *bytes)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct mcba_usb_pcpu_stats *st = per_cpu_ptr(pcpu, cpu);
+		unsigned int start;
+		u64 p, b;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&st->syncp);
+			p = st->packets;
+			b = st->bytes;
+		} while (u64_stats_fetch_retry_irq(&st->syncp, start));
+
+		*packets += p;
+		*bytes += b;
+	}
+}
+
+static void mcba_usb_get_stats64(struct net_device *netdev,
+				 struct rtnl_link_stats64 *stats)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	netdev_stats_to_stats64(stats, &netdev->stats);
+
+	mcba_usb_sum_stats(priv->rx_stats, &stats->rx_packets,
+			   &stats->rx_bytes);
+	mcba_usb_sum_stats(priv->tx_stats, &stats->tx_packets,
+			   &stats->tx_bytes);
+}
+
+static const struct net_device_ops mcba_netdev_ops = {
+	.ndo_open = mcba_usb_open,
+	.ndo_stop = mcba_usb_close,
+	.ndo_start_xmit = mcba_usb_start_xmit,
+	.ndo_select_queue = mcba_usb_select_queue,
+	.ndo_get_stats64 = mcba_usb_get_stats64,
+	.ndo_do_ioctl = mcba_usb_ioctl
+};
+
+static int mcba_usb_get_ts_info(struct net_device *netdev,
+				struct ethtool_ts_info *info)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	info->so_timestamping = SOF_TIMESTAMPING_RX_SOFTWARE |
+				SOF_TIMESTAMPING_SOFTWARE |
+				SOF_TIMESTAMPING_RX_HARDWARE |
+				SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) |
+			   BIT(HWTSTAMP_FILTER_ALL);
+
+	if (priv->echo_rsp) {
+		info->so_timestamping |= SOF_TIMESTAMPING_TX_HARDWARE;
+		info->tx_types |= BIT(HWTSTAMP_TX_ON);
+	}
+
+	return 0;
+}
+
+static void mcba_usb_get_ringparam(struct net_device *netdev,
+				   struct ethtool_ringparam *ring)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	ring->rx_max_pending = MCBA_MAX_RX_URBS;
+	ring->tx_max_pending = MCBA_MAX_TX_URBS;
+
+	/* report what is actually in flight, start may get less than asked */
+	if (netif_running(netdev))
+		ring->rx_pending = priv->rx_urbs_cnt;
+	else
+		ring->rx_pending = priv->rx_ring_size;
+
+	ring->tx_pending = priv->tx_ring_size;
+}
+
+static int mcba_usb_set_ringparam(struct net_device *netdev,
+				  struct ethtool_ringparam *ring)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+
+	if (!ring->rx_pending || ring->rx_pending > MCBA_MAX_RX_URBS ||
+	    !ring->tx_pending || ring->tx_pending > MCBA_MAX_TX_URBS)
+		return -EINVAL;
+
+	/* URBs are in use by the device, resize across ifdown/ifup */
+	if (netif_running(netdev))
+		return -EBUSY;
+
+	priv->rx_ring_size = ring->rx_pending;
+	priv->tx_ring_size = ring->tx_pending;
+
+	return 0;
+}
+
+static int mcba_usb_get_coalesce(struct net_device *netdev,
+				 struct ethtool_coalesce *ec)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	ec->rx_coalesce_usecs = priv->rx_usecs;
+	ec->rx_coalesce_usecs_low = priv->rx_usecs_low;
+	ec->rx_max_coalesced_frames = priv->rx_frames;
+	ec->use_adaptive_rx_coalesce = priv->rx_adaptive;
+
+	return 0;
+}
+
+/* Takes effect with the next RX completion, also while running */
+static int mcba_usb_set_coalesce(struct net_device *netdev,
+				 struct ethtool_coalesce *ec)
+{
+	struct mcba_priv *priv = netdev_priv(netdev);
+
+	if (ec->rx_coalesce_usecs > MCBA_RX_USECS_MAX ||
+	    ec->rx_coalesce_usecs_low > MCBA_RX_USECS_MAX ||
+	    !ec->rx_max_coalesced_frames ||
+	    ec->rx_max_coalesced_frames > MCBA_MAX_RX_URBS)
+		return -EINVAL;
+
+	WRITE_ONCE(priv->rx_usecs, ec->rx_coalesce_usecs);
+	WRITE_ONCE(priv->rx_usecs_low, ec->rx_coalesce_usecs_low);
+	WRITE_ONCE(priv->rx_frames, ec->rx_max_coalesced_frames);
+	WRITE_ONCE(priv->rx_adaptive, !!ec->use_adaptive_rx_coalesce);
+
+	return 0;
+}
+
+#define MCBA_XSTAT(_set, _name) \
+	{ .name = #_name, .offset = offsetof(struct mcba_priv, _set._name) }
+
+static const struct {
+	const char name[ETH_GSTRING_LEN];
+	size_t offset;
+} mcba_usb_xstats_desc[] = {
+	MCBA_XSTAT(rx_xstats, fw_rx_buff_ovfl),
+	MCBA_XSTAT(rx_xstats, fw_rx_lost),
+	MCBA_XSTAT(rx_xstats, fw_tx_bus_off),
+	MCBA_XSTAT(rx_xstats, fw_can_stat),
+	MCBA_XSTAT(rx_xstats, rx_resubmit_err),
+	MCBA_XSTAT(rx_xstats, rx_urb_parked),
+	MCBA_XSTAT(rx_xstats, rx_urb_unparked),
+	MCBA_XSTAT(rx_xstats, rx_format_err),
+	MCBA_XSTAT(rx_xstats, rx_alloc_err),
+	MCBA_XSTAT(rx_xstats, rx_filtered),
+	MCBA_XSTAT(rx_xstats, rx_csum_err),
+	MCBA_XSTAT(tx_xstats, tx_busy),
+	MCBA_XSTAT(tx_xstats, tx_submit_err),
+	MCBA_XSTAT(tx_xstats, lb_filtered),
+	MCBA_XSTAT(tx_xstats, lb_alloc_err),
+	MCBA_XSTAT(rx_xstats, urb_alloc_err),
+	MCBA_XSTAT(tx_xstats, cmd_coalesced),
+	MCBA_XSTAT(tx_xstats, cmd_err),
+};
+
+static int mcba_usb_get_sset_count(struct net_device *netdev, int sset)
 {
-	int i = 0;
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(mcba_usb_xstats_desc);
 
-	for (i = 0; i < MCBA_MAX_TX_URBS; i++)
-		priv->tx_context[i].ndx = MCBA_CTX_FREE;
+	default:
+		return -EOPNOTSUPP;
+	}
 }
 
-static inline struct mcba_usb_ctx *mcba_usb_get_free_ctx(struct mcba_priv *priv)
+static void mcba_usb_get_strings(struct net_device *netdev, u32 sset, u8 *data)
 {
-	int i = 0;
-	struct mcba_usb_ctx *ctx = 0;
+	int i;
 
-	for (i = 0; i < MCBA_MAX_TX_URBS; i++) {
-		if (priv->tx_context[i].ndx == MCBA_CTX_FREE) {
-			ctx = &priv->tx_context[i];
-			ctx->ndx = i;
-			ctx->priv = priv;
-			break;
-		}
-	}
+	if (sset != ETH_SS_STATS)
+		return;
 
-	return ctx;
+	for (i = 0; i < ARRAY_SIZE(mcba_usb_xstats_desc); i++)
+		memcpy(data + i * ETH_GSTRING_LEN, mcba_usb_xstats_desc[i].name,
+		       ETH_GSTRING_LEN);
 }
 
-static inline void mcba_usb_free_ctx(struct mcba_usb_ctx *ctx)
+static void mcba_usb_get_ethtool_stats(struct net_device *netdev,
+				       struct ethtool_stats *stats, u64 *data)
 {
-	ctx->ndx = MCBA_CTX_FREE;
-	ctx->priv = 0;
-	ctx->dlc = 0;
-	ctx->can = false;
-}
+	struct mcba_priv *priv = netdev_priv(netdev);
+	const u8 *base = (const u8 *)priv;
+	int i;
 
-static void mcba_usb_write_bulk_callback(struct urb *urb)
-{
-	struct mcba_usb_ctx *ctx = urb->context;
-	struct net_device *netdev;
+	for (i = 0; i < ARRAY_SIZE(mcba_usb_xstats_desc); i++) {
+		size_t offset = mcba_usb_xstats_desc[i].offset;
 
-	WARN_ON(!ctx);
+		data[i] = *(const unsigned long *)(base + offset);
+	}
+}
 
-	netdev = ctx->priv->netdev;
+static int mcba_usb_lat_show(struct seq_file *m, void *v)
+{
+	struct mcba_usb_lat_hist *hist = m->private;
+	int last, i;
 
-	if (ctx->can) {
-		if (!netif_device_present(netdev))
-			return;
+	for (last = MCBA_LAT_BUCKETS - 1; last > 0; last--)
+		if (hist->cnt[last])
+			break;
 
-		netdev->stats.tx_packets++;
-		netdev->stats.tx_bytes += ctx->dlc;
+	seq_puts(m, "     usecs            : count\n");
 
-		can_get_echo_skb(netdev, ctx->ndx);
+	for (i = 0; i <= last; i++) {
+		u64 lo = i ? 1ULL << (i - 1) : 0;
+		u64 hi = (1ULL << i) - 1;
 
-		netif_wake_queue(netdev);
+		seq_printf(m, "%10llu -> %-10llu: %lu\n", lo, hi,
+			   hist->cnt[i]);
 	}
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-
-	if (urb->status)
-		netdev_info(netdev, "Tx URB aborted (%d)\n",
-			    urb->status);
-
-	/* Release context */
-	mcba_usb_free_ctx(ctx);
+	return 0;
 }
 
-/* Send data to device */
-static netdev_tx_t mcba_usb_start_xmit(struct sk_buff *skb,
-				       struct net_device *netdev)
+static int mcba_usb_lat_open(struct inode *inode, struct file *file)
 {
-	struct mcba_priv *priv = netdev_priv(netdev);
-	struct can_frame *cf = (struct can_frame *)skb->data;
-	struct mcba_usb_msg_can usb_msg;
+	return single_open(file, mcba_usb_lat_show, inode->i_private);
+}
 
-	usb_msg.cmd_id = MBCA_CMD_TRANSMIT_MESSAGE_EV;
-	memcpy(usb_msg.data, cf->data, sizeof(usb_msg.data));
+/* any write clears the histogram */
+static ssize_t mcba_usb_lat_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct mcba_usb_lat_hist *hist = m->private;
 
-	if (MCBA_TX_IS_EXID(cf)) {
-		usb_msg.sidl = MCBA_SET_E_SIDL(cf->can_id);
-		usb_msg.sidh = MCBA_SET_E_SIDH(cf->can_id);
-		usb_msg.eidl = MCBA_SET_EIDL(cf->can_id);
-		usb_msg.eidh = MCBA_SET_EIDH(cf->can_id);
-	} else {
-		usb_msg.sidl = MCBA_SET_S_SIDL(cf->can_id);
-		usb_msg.sidh = MCBA_SET_S_SIDH(cf->can_id);
-		usb_msg.eidl = 0;
-		usb_msg.eidh = 0;
-	}
+	memset(hist, 0, sizeof(*hist));
 
-	usb_msg.dlc = cf->can_dlc;
+	return count;
+}
 
-	if (MCBA_TX_IS_RTR(cf))
-		usb_msg.dlc |= MCBA_DLC_RTR_MASK;
+static const struct file_operations mcba_usb_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = mcba_usb_lat_open,
+	.read = seq_read,
+	.write = mcba_usb_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	return mcba_usb_xmit(priv, (struct mcba_usb_msg *)&usb_msg, skb);
-}
+/* serializes attaching captures to devices with detaching them */
+static DEFINE_MUTEX(mcba_cap_lock);
 
-/* Send data to device */
-static void mcba_usb_xmit_cmd(struct mcba_priv *priv,
-			      struct mcba_usb_msg *usb_msg)
+static void mcba_usb_cap_free(struct mcba_usb_cap *cap)
 {
-	mcba_usb_xmit(priv, usb_msg, 0);
+	vfree(cap->mem);
+	kfree(cap);
 }
 
-/* Send data to device */
-static netdev_tx_t mcba_usb_xmit(struct mcba_priv *priv,
-				 struct mcba_usb_msg *usb_msg,
-				 struct sk_buff *skb)
+static int mcba_usb_cap_open(struct inode *inode, struct file *file)
 {
-	struct net_device_stats *stats = &priv->netdev->stats;
-	struct mcba_usb_ctx *ctx = 0;
-	struct urb *urb;
-	u8 *buf;
+	struct dentry *dentry = file->f_path.dentry;
+	struct mcba_priv *priv = inode->i_private;
+	struct mcba_usb_cap *cap;
+	unsigned int cnt;
 	int err;
 
-	ctx = mcba_usb_get_free_ctx(priv);
-	if (!ctx) {
-		/* Slow down tx path */
-		netif_stop_queue(priv->netdev);
-
-		return NETDEV_TX_BUSY;
-	}
-
-	if (skb) {
-		ctx->dlc = ((struct mcba_usb_msg_can *)usb_msg)->dlc
-				& MCBA_DLC_MASK;
-		can_put_echo_skb(skb, priv->netdev, ctx->ndx);
-		ctx->can = true;
-	} else {
-		ctx->can = false;
-	}
+	cnt = clamp_t(unsigned int, capture_records, MCBA_CAP_MIN_RECORDS,
+		      MCBA_CAP_MAX_RECORDS);
+	cnt = roundup_pow_of_two(cnt);
 
-	/* create a URB, and a buffer for it, and copy the data to the URB */
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	if (!urb) {
-		netdev_err(priv->netdev, "No memory left for URBs\n");
-		goto nomem;
-	}
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return -ENOMEM;
 
-	buf = usb_alloc_coherent(priv->udev, MCBA_USB_TX_BUFF_SIZE, GFP_ATOMIC,
-				 &urb->transfer_dma);
-	if (!buf) {
-		netdev_err(priv->netdev, "No memory left for USB buffer\n");
-		goto nomembuf;
+	cap->size = PAGE_SIZE + PAGE_ALIGN(cnt * sizeof(struct mcba_cap_rec));
+	cap->mem = vmalloc_user(cap->size);
+	if (!cap->mem) {
+		kfree(cap);
+		return -ENOMEM;
 	}
 
-	memcpy(buf, usb_msg, MCBA_USB_TX_BUFF_SIZE);
-
-	usb_fill_bulk_urb(urb, priv->udev,
-			  usb_sndbulkpipe(priv->udev, MCBA_USB_EP_OUT), buf,
-			  MCBA_USB_TX_BUFF_SIZE, mcba_usb_write_bulk_callback,
-			  ctx);
+	cap->hdr = cap->mem;
+	cap->rec = cap->mem + PAGE_SIZE;
+	cap->mask = cnt - 1;
+	init_waitqueue_head(&cap->wait);
 
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &priv->tx_submitted);
+	cap->hdr->magic = MCBA_CAP_MAGIC;
+	cap->hdr->version = MCBA_CAP_VERSION;
+	cap->hdr->rec_size = sizeof(struct mcba_cap_rec);
+	cap->hdr->rec_cnt = cnt;
+	cap->hdr->data_offset = PAGE_SIZE;
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (unlikely(err))
-		goto failed;
+	/* unsafe file for mmap, keeps disconnect from removing it under us */
+	err = debugfs_file_get(dentry);
+	if (err) {
+		mcba_usb_cap_free(cap);
+		return err;
+	}
 
-	/* Release our reference to this URB, the USB core will eventually free
-	 * it entirely.
-	 */
-	usb_free_urb(urb);
+	mutex_lock(&mcba_cap_lock);
 
-	return NETDEV_TX_OK;
+	if (rcu_access_pointer(priv->cap)) {
+		err = -EBUSY;
+	} else {
+		cap->priv = priv;
+		rcu_assign_pointer(priv->cap, cap);
+	}
 
-failed:
-	usb_unanchor_urb(urb);
-	usb_free_coherent(priv->udev, MCBA_USB_TX_BUFF_SIZE, buf,
-			  urb->transfer_dma);
+	mutex_unlock(&mcba_cap_lock);
 
-	if (err == -ENODEV)
-		netif_device_detach(priv->netdev);
-	else
-		netdev_warn(priv->netdev, "failed tx_urb %d\n", err);
+	debugfs_file_put(dentry);
 
-nomembuf:
-	usb_free_urb(urb);
+	if (err) {
+		mcba_usb_cap_free(cap);
+		return err;
+	}
 
-nomem:
-	can_free_echo_skb(priv->netdev, ctx->ndx);
-	dev_kfree_skb(skb);
-	stats->tx_dropped++;
+	file->private_data = cap;
 
-	return NETDEV_TX_OK;
+	return nonseekable_open(inode, file);
 }
 
-static void mcba_usb_xmit_change_bitrate(struct mcba_priv *priv, u16 bitrate)
+static int mcba_usb_cap_release(struct inode *inode, struct file *file)
 {
-	struct mcba_usb_msg_change_bitrate usb_msg;
+	struct mcba_usb_cap *cap = file->private_data;
 
-	usb_msg.cmd_id =  MBCA_CMD_CHANGE_BIT_RATE;
-	usb_msg.bitrate_hi = (0xff00 & bitrate) >> 8;
-	usb_msg.bitrate_lo = (0xff & bitrate);
+	mutex_lock(&mcba_cap_lock);
 
-	mcba_usb_xmit_cmd(priv, (struct mcba_usb_msg *)&usb_msg);
-}
+	if (cap->priv)
+		RCU_INIT_POINTER(cap->priv->cap, NULL);
 
-static void mcba_usb_xmit_read_fw_ver(struct mcba_priv *priv, u8 pic)
-{
-	struct mcba_usb_msg_fw_ver usb_msg;
+	mutex_unlock(&mcba_cap_lock);
 
-	usb_msg.cmd_id = MBCA_CMD_READ_FW_VERSION;
-	usb_msg.pic = pic;
+	/* wait for a concurrent mcba_usb_poll() to let go of the ring */
+	synchronize_rcu();
+	mcba_usb_cap_free(cap);
 
-	mcba_usb_xmit_cmd(priv, (struct mcba_usb_msg *)&usb_msg);
+	return 0;
 }
 
-static void mcba_usb_xmit_termination(struct mcba_priv *priv, u8 termination)
+/* vmalloc_user() memory, remap_vmalloc_range() checks the bounds */
+static int mcba_usb_cap_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	struct mcba_usb_msg_terminaton usb_msg;
-
-	usb_msg.cmd_id = MBCA_CMD_SETUP_TERMINATION_RESISTANCE;
-	usb_msg.termination = termination;
+	struct mcba_usb_cap *cap = file->private_data;
 
-	mcba_usb_xmit_cmd(priv, (struct mcba_usb_msg *)&usb_msg);
+	return remap_vmalloc_range(vma, cap->mem, vma->vm_pgoff);
 }
 
-/* Open USB device */
-static int mcba_usb_open(struct net_device *netdev)
+static __poll_t mcba_usb_cap_poll(struct file *file, poll_table *wait)
 {
-	int err;
+	struct mcba_usb_cap *cap = file->private_data;
+	__poll_t mask = 0;
 
-	/* common open */
-	err = open_candev(netdev);
-	if (err)
-		return err;
+	poll_wait(file, &cap->wait, wait);
 
-	can_led_event(netdev, CAN_LED_EVENT_OPEN);
+	if (smp_load_acquire(&cap->hdr->head) != READ_ONCE(cap->hdr->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
 
-	netif_start_queue(netdev);
+	if (!READ_ONCE(cap->priv))
+		mask |= EPOLLHUP;
 
-	return 0;
+	return mask;
 }
 
-static void mcba_urb_unlink(struct mcba_priv *priv)
-{
-	usb_kill_anchored_urbs(&priv->rx_submitted);
-	usb_kill_anchored_urbs(&priv->tx_submitted);
-}
+static const struct file_operations mcba_usb_cap_fops = {
+	.owner = THIS_MODULE,
+	.open = mcba_usb_cap_open,
+	.release = mcba_usb_cap_release,
+	.mmap = mcba_usb_cap_mmap,
+	.poll = mcba_usb_cap_poll,
+	.llseek = no_llseek,
+};
 
-/* Close USB device */
-static int mcba_usb_close(struct net_device *netdev)
+/* Device is going away, an open capture stays mapped but gets no records */
+static void mcba_usb_cap_detach(struct mcba_priv *priv)
 {
-	struct mcba_priv *priv = netdev_priv(netdev);
-
-	priv->can.state = CAN_STATE_STOPPED;
-
-	netif_stop_queue(netdev);
-
-	/* Stop polling */
-	mcba_urb_unlink(priv);
+	struct mcba_usb_cap *cap;
 
-	close_candev(netdev);
+	mutex_lock(&mcba_cap_lock);
 
-	can_led_event(netdev, CAN_LED_EVENT_STOP);
+	cap = rcu_dereference_protected(priv->cap,
+					lockdep_is_held(&mcba_cap_lock));
+	if (cap) {
+		WRITE_ONCE(cap->priv, NULL);
+		RCU_INIT_POINTER(priv->cap, NULL);
+		wake_up_interruptible(&cap->wait);
+	}
 
-	return 0;
+	mutex_unlock(&mcba_cap_lock);
 }
 
-/* Set network device mode
- *
- * Maybe we should leave this function empty, because the device
- * set mode variable with open command.
- */
-static int mcba_net_set_mode(struct net_device *netdev, enum can_mode mode)
+static struct dentry *mcba_debugfs_root;
+
+/* debugfs is optional, failures are not reported */
+static void mcba_usb_debugfs_init(struct mcba_priv *priv,
+				  struct usb_interface *intf)
 {
-	return 0;
+	priv->debugfs = debugfs_create_dir(dev_name(&intf->dev),
+					   mcba_debugfs_root);
+
+	debugfs_create_file("tx_latency", 0600, priv->debugfs, &priv->tx_lat,
+			    &mcba_usb_lat_fops);
+	debugfs_create_file("rx_latency", 0600, priv->debugfs, &priv->rx_lat,
+			    &mcba_usb_lat_fops);
+	/* the debugfs proxy fops have no mmap */
+	debugfs_create_file_unsafe("capture", 0600, priv->debugfs, priv,
+				   &mcba_usb_cap_fops);
 }
 
-static int mcba_net_get_berr_counter(const struct net_device *netdev,
-				     struct can_berr_counter *bec)
+/* shared by all analyzers, next to their directories */
+static void mcba_usb_fault_init(void)
 {
-	struct mcba_priv *priv = netdev_priv(netdev);
-
-	bec->txerr = priv->bec.txerr;
-	bec->rxerr = priv->bec.rxerr;
-
-	return 0;
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	fault_create_debugfs_attr("fail_urb_submit", mcba_debugfs_root,
+				  &mcba_fail_urb_submit);
+	fault_create_debugfs_attr("fail_urb_complete", mcba_debugfs_root,
+				  &mcba_fail_urb_complete);
+	fault_create_debugfs_attr("fail_alloc", mcba_debugfs_root,
+				  &mcba_fail_alloc);
+#endif
 }
 
-static const struct net_device_ops mcba_netdev_ops = {
-	.ndo_open = mcba_usb_open,
-	.ndo_stop = mcba_usb_close,
-	.ndo_start_xmit = mcba_usb_start_xmit
+static const struct ethtool_ops mcba_ethtool_ops = {
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+				     ETHTOOL_COALESCE_RX_USECS_LOW |
+				     ETHTOOL_COALESCE_RX_MAX_FRAMES |
+				     ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+	.get_ts_info = mcba_usb_get_ts_info,
+	.get_sset_count = mcba_usb_get_sset_count,
+	.get_strings = mcba_usb_get_strings,
+	.get_ethtool_stats = mcba_usb_get_ethtool_stats,
+	.get_ringparam = mcba_usb_get_ringparam,
+	.set_ringparam = mcba_usb_set_ringparam,
+	.get_coalesce = mcba_usb_get_coalesce,
+	.set_coalesce = mcba_usb_set_coalesce
 };
 
 /* Microchip CANBUS has hardcoded bittiming values by default.
@@ -1077,33 +3982,20 @@ static const struct net_device_ops mcba_netdev_ops = {
  */
 static int mcba_net_set_bittiming(struct net_device *netdev)
 {
-	u8 i;
 	struct mcba_priv *priv = netdev_priv(netdev);
-	struct can_bittiming *bt = &priv->can.bittiming;
-	const struct bitrate_settings *settings = 0;
-	const u8 setting_cnt = sizeof(br_settings) /
-			       sizeof(struct bitrate_settings);
-
-	for (i = 0; i < setting_cnt; ++i)
-		if (br_settings[i].bt.bitrate == bt->bitrate)
-			settings = &br_settings[i];
+	const struct bitrate_settings *settings;
 
-	if (settings) {
-		memcpy(bt, &settings->bt, sizeof(struct can_bittiming));
-
-		/* recalculate bitrate as it may be different than default */
-		bt->bitrate = 1000000000 / ((bt->sjw + bt->prop_seg +
-					    bt->phase_seg1 + bt->phase_seg2) *
-					    bt->tq);
-
-		mcba_usb_xmit_change_bitrate(priv, settings->kbps);
-	} else {
+	settings = mcba_usb_find_bitrate(priv->can.bittiming.bitrate);
+	if (!settings) {
 		netdev_err(netdev, "Unsupported bittrate (%u). Use one of: 20000, 33333, 50000, 80000, 83333, 100000, 125000, 150000, 175000, 200000, 225000, 250000, 275000, 300000, 500000, 625000, 800000, 1000000\n",
-			   bt->bitrate);
+			   priv->can.bittiming.bitrate);
 
 		return -EINVAL;
 	}
 
+	/* bittiming is set while down, the device gets it on open */
+	mcba_usb_apply_bitrate(priv, settings);
+
 	return 0;
 }
 
@@ -1117,7 +4009,8 @@ static int mcba_usb_probe(struct usb_interface *intf,
 
 	dev_info(&intf->dev, "Microchip CAN BUS analizer connected\n");
 
-	netdev = alloc_candev(sizeof(struct mcba_priv), MCBA_MAX_TX_URBS);
+	netdev = alloc_candev_mqs(sizeof(struct mcba_priv), MCBA_MAX_TX_URBS,
+				  tx_prio_slots ? MCBA_TX_QUEUES : 1, 1);
 	if (!netdev) {
 		dev_err(&intf->dev, "Couldn't alloc candev\n");
 		return -ENOMEM;
@@ -1126,24 +4019,56 @@ static int mcba_usb_probe(struct usb_interface *intf,
 	priv = netdev_priv(netdev);
 
 	priv->udev = usbdev;
+	priv->intf = intf;
 	priv->netdev = netdev;
 	priv->usb_ka_first_pass = true;
 	priv->can_ka_first_pass = true;
 
+	mcba_usb_init_ts(priv);
+
+	priv->echo_rsp = echo_rsp;
+	spin_lock_init(&priv->rsp_lock);
+
 	init_usb_anchor(&priv->rx_submitted);
+	init_usb_anchor(&priv->rx_done);
+	init_usb_anchor(&priv->rx_failed);
+	init_usb_anchor(&priv->rx_parked);
 	init_usb_anchor(&priv->tx_submitted);
 
-	usb_set_intfdata(intf, priv);
+	priv->rx_stats = netdev_alloc_pcpu_stats(struct mcba_usb_pcpu_stats);
+	priv->tx_stats = netdev_alloc_pcpu_stats(struct mcba_usb_pcpu_stats);
+	if (!priv->rx_stats || !priv->tx_stats) {
+		err = -ENOMEM;
+		goto cleanup_stats;
+	}
 
-	err = mcba_usb_start(priv);
+	/* commands may be sent as soon as the device is registered */
+	err = mcba_usb_cmd_init(priv);
 	if (err) {
-		if (err == -ENODEV)
-			netif_device_detach(priv->netdev);
+		dev_err(&intf->dev, "Couldn't alloc command URB\n");
+		goto cleanup_stats;
+	}
 
-		netdev_warn(netdev, "couldn't start device: %d\n", err);
+	netif_napi_add(netdev, &priv->napi, mcba_usb_poll, NAPI_POLL_WEIGHT);
+	priv->rx_cpu = -1;
+	INIT_WORK(&priv->rx_work, mcba_usb_rx_work);
+	INIT_WORK(&priv->info_work, mcba_usb_info_work);
+	timer_setup(&priv->load.timer, mcba_usb_load_timer, 0);
+	timer_setup(&priv->rx_retry, mcba_usb_rx_retry, 0);
+	hrtimer_init(&priv->rx_coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->rx_coal_timer.function = mcba_usb_rx_coal_timer;
+
+	priv->rx_usecs = MCBA_RX_USECS_DEF;
+	priv->rx_usecs_low = MCBA_RX_USECS_LOW_DEF;
+	priv->rx_frames = MCBA_RX_FRAMES_DEF;
+	priv->rx_adaptive = false;
+
+	priv->rx_ring_size = MCBA_DEF_RX_URBS;
+	priv->tx_ring_size = MCBA_DEF_TX_URBS;
+	priv->tx_prio_slots = tx_prio_slots;
+	priv->rx_buf_size = MCBA_USB_RX_BUFF_SIZE;
 
-		goto cleanup_candev;
-	}
+	usb_set_intfdata(intf, priv);
 
 	/* Init CAN device */
 	priv->can.state = CAN_STATE_STOPPED;
@@ -1152,33 +4077,107 @@ static int mcba_usb_probe(struct usb_interface *intf,
 	priv->can.do_set_mode = mcba_net_set_mode;
 	priv->can.do_get_berr_counter = mcba_net_get_berr_counter;
 	priv->can.do_set_bittiming = mcba_net_set_bittiming;
-	priv->can.ctrlmode_supported = CAN_CTRLMODE_LOOPBACK |
-			CAN_CTRLMODE_LISTENONLY |
-			CAN_CTRLMODE_ONE_SHOT;
+	/* Emulated by the driver, see mcba_usb_start_xmit(). The firmware
+	 * can neither disable retransmission (ONE_SHOT) nor ACKs and error
+	 * frames (LISTENONLY), tx_disable only drops frames in the driver.
+	 */
+	priv->can.ctrlmode_supported = CAN_CTRLMODE_LOOPBACK;
 
 	netdev->netdev_ops = &mcba_netdev_ops;
+	netdev->ethtool_ops = &mcba_ethtool_ops;
 
 	netdev->flags |= IFF_ECHO; /* we support local echo */
 
 	SET_NETDEV_DEV(netdev, &intf->dev);
 
+	/* Queued before the interface can be opened, so open always finds
+	 * it. Nothing above talked to the device, probe returns right away.
+	 */
+	schedule_work(&priv->info_work);
+
 	err = register_candev(netdev);
 	if (err) {
 		netdev_err(netdev,
 			   "couldn't register CAN device: %d\n", err);
-		goto cleanup_candev;
+		goto cleanup_info;
 	}
 
 	err = device_create_file(&netdev->dev, &termination_attr);
 	if (err)
 		goto cleanup_unregister_candev;
 
+	err = device_create_file(&netdev->dev, &filter_attr);
+	if (err)
+		goto cleanup_termination;
+
+	err = device_create_file(&netdev->dev, &rx_cpu_attr);
+	if (err)
+		goto cleanup_filter;
+
+	err = device_create_file(&netdev->dev, &tx_prio_id_attr);
+	if (err)
+		goto cleanup_rx_cpu;
+
+	err = device_create_file(&netdev->dev, &bitrate_attr);
+	if (err)
+		goto cleanup_tx_prio_id;
+
+	err = device_create_file(&netdev->dev, &usb_fw_version_attr);
+	if (err)
+		goto cleanup_bitrate;
+
+	err = device_create_file(&netdev->dev, &can_fw_version_attr);
+	if (err)
+		goto cleanup_usb_fw_version;
+
+	err = device_create_file(&netdev->dev, &tx_disable_attr);
+	if (err)
+		goto cleanup_can_fw_version;
+
+	err = sysfs_create_group(&netdev->dev.kobj, &mcba_usb_load_group);
+	if (err)
+		goto cleanup_tx_disable;
+
+	mcba_usb_debugfs_init(priv, intf);
+
 	return err;
 
+cleanup_tx_disable:
+	device_remove_file(&netdev->dev, &tx_disable_attr);
+
+cleanup_can_fw_version:
+	device_remove_file(&netdev->dev, &can_fw_version_attr);
+
+cleanup_usb_fw_version:
+	device_remove_file(&netdev->dev, &usb_fw_version_attr);
+
+cleanup_bitrate:
+	device_remove_file(&netdev->dev, &bitrate_attr);
+
+cleanup_tx_prio_id:
+	device_remove_file(&netdev->dev, &tx_prio_id_attr);
+
+cleanup_rx_cpu:
+	device_remove_file(&netdev->dev, &rx_cpu_attr);
+
+cleanup_filter:
+	device_remove_file(&netdev->dev, &filter_attr);
+
+cleanup_termination:
+	device_remove_file(&netdev->dev, &termination_attr);
+
 cleanup_unregister_candev:
 	unregister_candev(netdev);
 
-cleanup_candev:
+cleanup_info:
+	cancel_work_sync(&priv->info_work);
+	mcba_usb_cmd_release(priv);
+	mcba_usb_free_rx_urbs(priv);
+	mcba_usb_free_tx_urbs(priv);
+
+cleanup_stats:
+	free_percpu(priv->tx_stats);
+	free_percpu(priv->rx_stats);
 	free_candev(netdev);
 
 	return err;
@@ -1189,28 +4188,176 @@ static void mcba_usb_disconnect(struct usb_interface *intf)
 {
 	struct mcba_priv *priv = usb_get_intfdata(intf);
 
-	device_remove_file(&priv->netdev->dev, &termination_attr);
-
 	usb_set_intfdata(intf, NULL);
 
 	if (priv) {
-		netdev_info(priv->netdev, "device disconnected\n");
+		struct net_device *netdev = priv->netdev;
+
+		netdev_info(netdev, "device disconnected\n");
+
+		sysfs_remove_group(&netdev->dev.kobj, &mcba_usb_load_group);
+		device_remove_file(&netdev->dev, &tx_disable_attr);
+		device_remove_file(&netdev->dev, &can_fw_version_attr);
+		device_remove_file(&netdev->dev, &usb_fw_version_attr);
+		device_remove_file(&netdev->dev, &bitrate_attr);
+		device_remove_file(&netdev->dev, &tx_prio_id_attr);
+		device_remove_file(&netdev->dev, &rx_cpu_attr);
+		device_remove_file(&netdev->dev, &filter_attr);
+		device_remove_file(&netdev->dev, &termination_attr);
+
+		/* bounded by MCBA_INFO_READS short reads */
+		cancel_work_sync(&priv->info_work);
 
-		unregister_candev(priv->netdev);
-		free_candev(priv->netdev);
+		/* closes the interface, which releases all URBs */
+		unregister_candev(netdev);
 
-		mcba_urb_unlink(priv);
+		mcba_usb_cmd_release(priv);
+		mcba_usb_free_rx_urbs(priv);
+		mcba_usb_free_tx_urbs(priv);
+
+		/* after debugfs, so no capture can be opened anymore */
+		debugfs_remove_recursive(priv->debugfs);
+		mcba_usb_cap_detach(priv);
+
+		/* sysfs and poll are gone, nobody can see the filter anymore */
+		kfree(rcu_access_pointer(priv->rx_filter));
+
+		free_percpu(priv->tx_stats);
+		free_percpu(priv->rx_stats);
+
+		/* priv goes with it */
+		free_candev(netdev);
+	}
+}
+
+/* TX URBs killed with the device detached never complete their frames */
+static void mcba_usb_tx_flush(struct mcba_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
+	unsigned int i;
+
+	for_each_set_bit(i, priv->tx_ctx_map, MCBA_MAX_TX_URBS) {
+		can_free_echo_skb(netdev, i);
+		netdev->stats.tx_dropped++;
+	}
+
+	mcba_init_ctx(priv);
+
+	for (i = 0; i < netdev->real_num_tx_queues; i++)
+		netdev_tx_reset_queue(netdev_get_tx_queue(netdev, i));
+}
+
+/* System sleep and autosuspend. An interface that is up holds a runtime PM
+ * reference, so only system sleep finds it running. URBs and buffers stay
+ * allocated, resume only resubmits them.
+ */
+static int mcba_usb_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct mcba_priv *priv = usb_get_intfdata(intf);
+	struct net_device *netdev = priv->netdev;
+
+	if (netif_running(netdev)) {
+		/* stops the TX queues, URB callbacks ignore what follows */
+		netif_device_detach(netdev);
+		mcba_usb_stop(priv);
+	}
+
+	mcba_usb_cmd_suspend(priv);
+
+	return 0;
+}
+
+static int mcba_usb_do_resume(struct usb_interface *intf, bool reset)
+{
+	struct mcba_priv *priv = usb_get_intfdata(intf);
+	struct net_device *netdev = priv->netdev;
+	int err;
+
+	mcba_usb_cmd_resume(priv);
+
+	/* the device came back with its power-on defaults */
+	if (reset) {
+		priv->ka_can_valid = false;
+		mcba_usb_ts_resync(priv);
+
+		err = mcba_usb_xmit_termination(priv, priv->termination_state);
+		if (err)
+			netdev_warn(netdev, "couldn't restore termination: %d\n",
+				    err);
+	}
+
+	if (!netif_running(netdev))
+		return 0;
+
+	mcba_usb_tx_flush(priv);
+	memset(&priv->rx_parser, 0, sizeof(priv->rx_parser));
+
+	napi_enable(&priv->napi);
+
+	/* NAPI stays enabled on failure, close still has to disable it */
+	err = mcba_usb_submit_rx_urbs(priv, GFP_NOIO);
+	if (err <= 0) {
+		netdev_warn(netdev, "couldn't resubmit read URBs: %d\n", err);
+
+		return err ? err : -ENOMEM;
+	}
+
+	if (reset) {
+		err = mcba_usb_xmit_change_bitrate(priv, priv->bitrate_kbps);
+		if (err)
+			netdev_warn(netdev, "couldn't restore bitrate: %d\n",
+				    err);
 	}
+
+	mcba_usb_load_start(priv);
+	netif_device_attach(netdev);
+
+	return 0;
+}
+
+static int mcba_usb_resume(struct usb_interface *intf)
+{
+	return mcba_usb_do_resume(intf, false);
+}
+
+static int mcba_usb_reset_resume(struct usb_interface *intf)
+{
+	return mcba_usb_do_resume(intf, true);
 }
 
 static struct usb_driver mcba_usb_driver = {
 	.name =		MCBA_MODULE_NAME,
 	.probe =	mcba_usb_probe,
 	.disconnect =	mcba_usb_disconnect,
+	.suspend =	mcba_usb_suspend,
+	.resume =	mcba_usb_resume,
+	.reset_resume =	mcba_usb_reset_resume,
 	.id_table =	mcba_usb_table,
+	.supports_autosuspend = 1,
 };
 
-module_usb_driver(mcba_usb_driver);
+static int __init mcba_usb_init(void)
+{
+	int err;
+
+	mcba_debugfs_root = debugfs_create_dir(MCBA_MODULE_NAME, NULL);
+	mcba_usb_fault_init();
+
+	err = usb_register(&mcba_usb_driver);
+	if (err)
+		debugfs_remove_recursive(mcba_debugfs_root);
+
+	return err;
+}
+
+static void __exit mcba_usb_exit(void)
+{
+	usb_deregister(&mcba_usb_driver);
+	debugfs_remove_recursive(mcba_debugfs_root);
+}
+
+module_init(mcba_usb_init);
+module_exit(mcba_usb_exit);
 
 MODULE_AUTHOR("Remigiusz Kołłątaj <remigiusz.kollataj@mobica.com>");
 MODULE_DESCRIPTION("SocketCAN driver for Microchip CAN BUS Analyzer Tool");
@@ -0,0 +1,58 @@
+/* Capture ring of the Microchip CAN BUS Analyzer Tool driver
+ *
+ * Copyright (C) 2016 Mobica Limited
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.
+ */
+
+/* Layout of debugfs mcba_usb/<usb interface>/capture, shared by the driver
+ * and userspace loggers. The file is mmap'ed whole: a header page followed
+ * by rec_cnt records.
+ */
+
+#ifndef _MCBA_USB_CAPTURE_H
+#define _MCBA_USB_CAPTURE_H
+
+#include <linux/types.h>
+
+#define MCBA_CAP_MAGIC           0x4d434150 /* "MCAP" */
+#define MCBA_CAP_VERSION         1
+
+/* head is written by the driver and tail by the reader, both count records
+ * since the file was opened. Record n lives at index n & (rec_cnt - 1).
+ * The reader loads head with acquire semantics, and stores tail with
+ * release semantics once it is done with the records.
+ */
+struct mcba_cap_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 rec_size;
+	__u32 rec_cnt; /* power of two */
+	__u32 data_offset; /* of the first record in the mapping, in bytes */
+	__u32 reserved;
+	__u64 head;
+	__u64 dropped; /* records lost while the ring was full */
+	__u64 reserved2[3];
+
+	/* own cache line, the only field userspace writes */
+	__u64 tail;
+};
+
+/* RECEIVE_MESSAGE record as it came from the device */
+struct mcba_cap_rec {
+	__u64 ts_ns; /* device timestamp converted to CLOCK_REALTIME */
+	__u8 msg[19];
+	__u8 pad[5];
+};
+
+#endif /* _MCBA_USB_CAPTURE_H */
@@ -0,0 +1,380 @@
+/* USB protocol of the Microchip CAN BUS Analyzer Tool
+ *
+ * Copyright (C) 2016 Mobica Limited
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.
+ */
+
+/* Message layout, CAN ID encoding and the RX record stream parser. Shared
+ * by the driver and the host side tests and benchmarks in tests/, so the
+ * code measured there is the code running in the kernel.
+ */
+
+#ifndef _MCBA_USB_PROTO_H
+#define _MCBA_USB_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/can.h>
+#include <asm/unaligned.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/can.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+#define __packed                 __attribute__((packed))
+#ifndef __always_inline /* glibc has one */
+#define __always_inline          inline __attribute__((always_inline))
+#endif
+
+static inline u32 get_unaligned_be32(const void *p)
+{
+	const u8 *b = (const u8 *)p;
+
+	return ((u32)b[0] << 24) | ((u32)b[1] << 16) | ((u32)b[2] << 8) | b[3];
+}
+#endif
+
+#define MCBA_USB_MSG_SIZE        19 /* for use before struct mcba_usb_msg */
+
+/* Microchip command id */
+#define MBCA_CMD_RECEIVE_MESSAGE                0xE3
+#define MBCA_CMD_I_AM_ALIVE_FROM_CAN            0xF5
+#define MBCA_CMD_I_AM_ALIVE_FROM_USB            0xF7
+#define MBCA_CMD_CHANGE_BIT_RATE                0xA1
+#define MBCA_CMD_TRANSMIT_MESSAGE_EV            0xA3
+#define MBCA_CMD_SETUP_TERMINATION_RESISTANCE   0xA8
+#define MBCA_CMD_READ_FW_VERSION                0xA9
+#define MBCA_CMD_NOTHING_TO_SEND                0xFF
+#define MBCA_CMD_TRANSMIT_MESSAGE_RSP           0xE2
+
+#define MCBA_VER_REQ_USB             1
+#define MCBA_VER_REQ_CAN             2
+
+#define MCBA_CAN_S_SID0_SID2_MASK    0x7
+#define MCBA_CAN_S_SID3_SID10_MASK   0x7F8
+#define MCBA_CAN_S_SID3_SID10_SHIFT  3
+
+#define MCBA_CAN_EID0_EID7_MASK      0xff
+#define MCBA_CAN_EID8_EID15_MASK     0xff00
+#define MCBA_CAN_EID16_EID17_MASK    0x30000
+#define MCBA_CAN_E_SID0_SID2_MASK    0x1c0000
+#define MCBA_CAN_E_SID3_SID10_MASK   0x1fe00000
+#define MCBA_CAN_EID8_EID15_SHIFT    8
+#define MCBA_CAN_EID16_EID17_SHIFT   16
+#define MCBA_CAN_E_SID0_SID2_SHIFT   18
+#define MCBA_CAN_E_SID3_SID10_SHIFT  21
+
+#define MCBA_SIDL_SID0_SID2_MASK     0xe0
+#define MCBA_SIDL_EXID_MASK          0x8
+#define MCBA_SIDL_EID16_EID17_MASK   0x3
+#define MCBA_SIDL_SID0_SID2_SHIFT    5
+
+#define MCBA_DLC_MASK                0xf
+#define MCBA_DLC_RTR_MASK            0x40
+
+#define MCBA_CAN_RTR_MASK            0x40000000
+#define MCBA_CAN_EXID_MASK           0x80000000
+
+#define MCBA_SET_S_SIDL(can_id)\
+(((can_id) & MCBA_CAN_S_SID0_SID2_MASK) << MCBA_SIDL_SID0_SID2_SHIFT)
+
+#define MCBA_SET_E_SIDL(can_id)\
+(((((can_id) & MCBA_CAN_E_SID0_SID2_MASK) >> MCBA_CAN_E_SID0_SID2_SHIFT)\
+<< MCBA_SIDL_SID0_SID2_SHIFT) |\
+(((can_id) & MCBA_CAN_EID16_EID17_MASK) >> MCBA_CAN_EID16_EID17_SHIFT) |\
+MCBA_SIDL_EXID_MASK)
+
+#define MCBA_SET_S_SIDH(can_id)\
+(((can_id) & MCBA_CAN_S_SID3_SID10_MASK) >> MCBA_CAN_S_SID3_SID10_SHIFT)
+
+#define MCBA_SET_E_SIDH(can_id)\
+(((can_id) & MCBA_CAN_E_SID3_SID10_MASK) >> MCBA_CAN_E_SID3_SID10_SHIFT)
+
+#define MCBA_SET_EIDL(can_id)\
+((can_id) & MCBA_CAN_EID0_EID7_MASK)
+
+#define MCBA_SET_EIDH(can_id)\
+(((can_id) & MCBA_CAN_EID8_EID15_MASK) >> MCBA_CAN_EID8_EID15_SHIFT)
+
+/* EIDH:EIDL:SIDH:SIDL read as one big endian word hold SID10..SID0 in
+ * bits 15..5, EID17..EID16 in bits 1..0 and EID15..EID0 in bits 31..16.
+ */
+#define MCBA_RAW_SID_SHIFT           5
+#define MCBA_RAW_EID0_EID15_SHIFT    16
+
+#define MCBA_RX_IS_EXID(usb_msg)    ((usb_msg)->sidl & MCBA_SIDL_EXID_MASK)
+#define MCBA_RX_IS_RTR(usb_msg)     ((usb_msg)->dlc & MCBA_DLC_RTR_MASK)
+#define MCBA_TX_IS_EXID(can_frame)  ((can_frame)->can_id & MCBA_CAN_EXID_MASK)
+#define MCBA_TX_IS_RTR(can_frame)   ((can_frame)->can_id & MCBA_CAN_RTR_MASK)
+
+/* command frame */
+struct __packed mcba_usb_msg_can {
+	u8 cmd_id;
+	u8 eidh;
+	u8 eidl;
+	u8 sidh;
+	u8 sidl;
+	u8 dlc;
+	u8 data[8];
+	u8 timestamp[4];
+	u8 checksum;
+};
+
+/* command frame */
+struct __packed mcba_usb_msg {
+	u8 cmd_id;
+	u8 unused[18];
+};
+
+struct __packed mcba_usb_msg_ka_usb {
+	u8 cmd_id;
+	u8 termination_state;
+	u8 soft_ver_major;
+	u8 soft_ver_minor;
+	u8 unused[15];
+};
+
+struct __packed mcba_usb_msg_ka_can {
+	u8 cmd_id;
+	u8 tx_err_cnt;
+	u8 rx_err_cnt;
+	u8 rx_buff_ovfl;
+	u8 tx_bus_off;
+	u8 can_bitrate_hi;
+	u8 can_bitrate_lo;
+	u8 rx_lost_lo;
+	u8 rx_lost_hi;
+	u8 can_stat;
+	u8 soft_ver_major;
+	u8 soft_ver_minor;
+	u8 debug_mode;
+	u8 test_complete;
+	u8 test_result;
+	u8 unused[4];
+};
+
+struct __packed mcba_usb_msg_change_bitrate {
+	u8 cmd_id;
+	u8 bitrate_hi;
+	u8 bitrate_lo;
+	u8 unused[16];
+};
+
+struct __packed mcba_usb_msg_terminaton {
+	u8 cmd_id;
+	u8 termination;
+	u8 unused[17];
+};
+
+struct __packed mcba_usb_msg_fw_ver {
+	u8 cmd_id;
+	u8 pic;
+	u8 unused[17];
+};
+
+/* TRANSMIT_MESSAGE_EV for a SocketCAN frame, all 8 data bytes are sent */
+static inline void mcba_usb_encode_can(struct mcba_usb_msg_can *msg,
+				       canid_t can_id, u8 dlc, const u8 *data)
+{
+	msg->cmd_id = MBCA_CMD_TRANSMIT_MESSAGE_EV;
+	memcpy(msg->data, data, sizeof(msg->data));
+
+	if (can_id & MCBA_CAN_EXID_MASK) {
+		msg->sidl = MCBA_SET_E_SIDL(can_id);
+		msg->sidh = MCBA_SET_E_SIDH(can_id);
+		msg->eidl = MCBA_SET_EIDL(can_id);
+		msg->eidh = MCBA_SET_EIDH(can_id);
+	} else {
+		msg->sidl = MCBA_SET_S_SIDL(can_id);
+		msg->sidh = MCBA_SET_S_SIDH(can_id);
+		msg->eidl = 0;
+		msg->eidh = 0;
+	}
+
+	msg->dlc = dlc;
+
+	if (can_id & MCBA_CAN_RTR_MASK)
+		msg->dlc |= MCBA_DLC_RTR_MASK;
+}
+
+/* One load instead of rebuilding the ID byte by byte. RTR is not part of
+ * the returned ID, see MCBA_RX_IS_RTR().
+ */
+static inline canid_t mcba_usb_decode_id(const struct mcba_usb_msg_can *msg)
+{
+	u32 raw = get_unaligned_be32(&msg->eidh);
+	canid_t sid = (raw >> MCBA_RAW_SID_SHIFT) & CAN_SFF_MASK;
+
+	if (!(raw & MCBA_SIDL_EXID_MASK))
+		return sid;
+
+	return (sid << MCBA_CAN_E_SID0_SID2_SHIFT) |
+	       ((raw & MCBA_SIDL_EID16_EID17_MASK) <<
+		MCBA_CAN_EID16_EID17_SHIFT) |
+	       (raw >> MCBA_RAW_EID0_EID15_SHIFT) |
+	       MCBA_CAN_EXID_MASK;
+}
+
+/* The checksum algorithm is not documented, firmware is assumed to send
+ * the 8-bit sum of all preceding bytes. Not confirmed against firmware
+ * captures yet.
+ */
+static inline u8 mcba_usb_csum(const struct mcba_usb_msg_can *msg)
+{
+	const u8 *p = (const u8 *)msg;
+	u8 sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < offsetof(struct mcba_usb_msg_can, checksum); i++)
+		sum += p[i];
+
+	return sum;
+}
+
+static inline bool mcba_usb_csum_ok(const struct mcba_usb_msg_can *msg)
+{
+	return mcba_usb_csum(msg) == msg->checksum;
+}
+
+static inline bool mcba_usb_rx_cmd_valid(u8 cmd_id)
+{
+	switch (cmd_id) {
+	case MBCA_CMD_RECEIVE_MESSAGE:
+	case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
+	case MBCA_CMD_I_AM_ALIVE_FROM_USB:
+	case MBCA_CMD_NOTHING_TO_SEND:
+	case MBCA_CMD_TRANSMIT_MESSAGE_RSP:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* State of the RX record stream, carried from one transfer to the next.
+ * Zeroed when the stream starts over.
+ */
+struct mcba_usb_rx_parser {
+	u8 frag[MCBA_USB_MSG_SIZE]; /* record split across transfers */
+	unsigned int frag_len;
+	bool resync;
+};
+
+/* While resynchronizing a record is only trusted if its cmd_id is known
+ * and, with csum, CAN records also carry a good checksum.
+ */
+static inline bool mcba_usb_rx_record_valid(const struct mcba_usb_rx_parser *p,
+					    const u8 *rec, bool csum)
+{
+	if (!mcba_usb_rx_cmd_valid(rec[0]))
+		return false;
+
+	if (!p->resync || !csum)
+		return true;
+
+	if (rec[0] != MBCA_CMD_RECEIVE_MESSAGE &&
+	    rec[0] != MBCA_CMD_TRANSMIT_MESSAGE_RSP)
+		return true;
+
+	return mcba_usb_csum_ok((const struct mcba_usb_msg_can *)rec);
+}
+
+/* lost_sync is called once per run of garbage */
+static __always_inline void
+mcba_usb_rx_lost_sync(struct mcba_usb_rx_parser *p, u8 cmd_id,
+		      void (*lost_sync)(void *ctx, u8 cmd_id), void *ctx)
+{
+	if (p->resync)
+		return;
+
+	p->resync = true;
+	lost_sync(ctx, cmd_id);
+}
+
+/* Parse one completed transfer, calling record for every message. Returns
+ * the number of messages.
+ *
+ * Records are expected back to back, but transfers may end in the middle
+ * of one. The tail is kept in frag and completed by the next transfer.
+ * After garbage the stream is scanned byte by byte for a valid record.
+ * Always inlined, so the callbacks become direct calls.
+ */
+static __always_inline int
+mcba_usb_rx_parse(struct mcba_usb_rx_parser *p, u8 *buf, unsigned int len,
+		  bool csum, void (*record)(void *ctx, struct mcba_usb_msg *msg),
+		  void (*lost_sync)(void *ctx, u8 cmd_id), void *ctx)
+{
+	const unsigned int msg_size = sizeof(struct mcba_usb_msg);
+	unsigned int pos = 0;
+	int cnt = 0;
+
+	if (p->frag_len) {
+		unsigned int n = msg_size - p->frag_len;
+
+		if (n > len)
+			n = len;
+
+		memcpy(p->frag + p->frag_len, buf, n);
+		p->frag_len += n;
+		pos = n;
+
+		if (p->frag_len < msg_size)
+			return 0;
+
+		p->frag_len = 0;
+
+		if (mcba_usb_rx_record_valid(p, p->frag, csum)) {
+			p->resync = false;
+			record(ctx, (struct mcba_usb_msg *)p->frag);
+			cnt++;
+		} else {
+			/* the fragment was junk, rescan this transfer */
+			mcba_usb_rx_lost_sync(p, p->frag[0], lost_sync, ctx);
+			pos = 0;
+		}
+	}
+
+	while (pos < len) {
+		/* a partial record is fully checked once it is complete */
+		if (len - pos < msg_size && mcba_usb_rx_cmd_valid(buf[pos])) {
+			memcpy(p->frag, buf + pos, len - pos);
+			p->frag_len = len - pos;
+			break;
+		}
+
+		if (len - pos < msg_size ||
+		    !mcba_usb_rx_record_valid(p, buf + pos, csum)) {
+			mcba_usb_rx_lost_sync(p, buf[pos], lost_sync, ctx);
+			pos++;
+			continue;
+		}
+
+		p->resync = false;
+		record(ctx, (struct mcba_usb_msg *)(buf + pos));
+		pos += msg_size;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+#endif /* _MCBA_USB_PROTO_H */
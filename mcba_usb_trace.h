@@ -0,0 +1,146 @@
+/* Tracepoints for the Microchip CAN BUS Analyzer Tool driver
+ *
+ * Copyright (C) 2016 Mobica Limited
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mcba_usb
+
+#if !defined(_MCBA_USB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MCBA_USB_TRACE_H
+
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+
+/* URB submission and completion, len is the requested resp. actual length */
+DECLARE_EVENT_CLASS(mcba_usb_urb,
+	TP_PROTO(const struct net_device *netdev, const void *urb, u32 len,
+		 int status),
+	TP_ARGS(netdev, urb, len, status),
+	TP_STRUCT__entry(
+		__string(name, netdev->name)
+		__field(const void *, urb)
+		__field(u32, len)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(name, netdev->name);
+		__entry->urb = urb;
+		__entry->len = len;
+		__entry->status = status;
+	),
+	TP_printk("%s urb=%p len=%u status=%d", __get_str(name),
+		  __entry->urb, __entry->len, __entry->status)
+);
+
+DEFINE_EVENT(mcba_usb_urb, mcba_usb_rx_submit,
+	TP_PROTO(const struct net_device *netdev, const void *urb, u32 len,
+		 int status),
+	TP_ARGS(netdev, urb, len, status)
+);
+
+DEFINE_EVENT(mcba_usb_urb, mcba_usb_rx_complete,
+	TP_PROTO(const struct net_device *netdev, const void *urb, u32 len,
+		 int status),
+	TP_ARGS(netdev, urb, len, status)
+);
+
+DEFINE_EVENT(mcba_usb_urb, mcba_usb_tx_submit,
+	TP_PROTO(const struct net_device *netdev, const void *urb, u32 len,
+		 int status),
+	TP_ARGS(netdev, urb, len, status)
+);
+
+DEFINE_EVENT(mcba_usb_urb, mcba_usb_tx_complete,
+	TP_PROTO(const struct net_device *netdev, const void *urb, u32 len,
+		 int status),
+	TP_ARGS(netdev, urb, len, status)
+);
+
+/* CAN frames entering the driver from either side */
+DECLARE_EVENT_CLASS(mcba_usb_frame,
+	TP_PROTO(const struct net_device *netdev, u32 can_id, u8 dlc),
+	TP_ARGS(netdev, can_id, dlc),
+	TP_STRUCT__entry(
+		__string(name, netdev->name)
+		__field(u32, can_id)
+		__field(u8, dlc)
+	),
+	TP_fast_assign(
+		__assign_str(name, netdev->name);
+		__entry->can_id = can_id;
+		__entry->dlc = dlc;
+	),
+	TP_printk("%s can_id=%08x dlc=%u", __get_str(name),
+		  __entry->can_id, __entry->dlc)
+);
+
+DEFINE_EVENT(mcba_usb_frame, mcba_usb_rx_frame,
+	TP_PROTO(const struct net_device *netdev, u32 can_id, u8 dlc),
+	TP_ARGS(netdev, can_id, dlc)
+);
+
+DEFINE_EVENT(mcba_usb_frame, mcba_usb_xmit,
+	TP_PROTO(const struct net_device *netdev, u32 can_id, u8 dlc),
+	TP_ARGS(netdev, can_id, dlc)
+);
+
+TRACE_EVENT(mcba_usb_echo,
+	TP_PROTO(const struct net_device *netdev, u32 ndx),
+	TP_ARGS(netdev, ndx),
+	TP_STRUCT__entry(
+		__string(name, netdev->name)
+		__field(u32, ndx)
+	),
+	TP_fast_assign(
+		__assign_str(name, netdev->name);
+		__entry->ndx = ndx;
+	),
+	TP_printk("%s ctx=%u", __get_str(name), __entry->ndx)
+);
+
+/* TX queue state changes, free is the number of free TX contexts */
+DECLARE_EVENT_CLASS(mcba_usb_queue,
+	TP_PROTO(const struct net_device *netdev, unsigned int free),
+	TP_ARGS(netdev, free),
+	TP_STRUCT__entry(
+		__string(name, netdev->name)
+		__field(unsigned int, free)
+	),
+	TP_fast_assign(
+		__assign_str(name, netdev->name);
+		__entry->free = free;
+	),
+	TP_printk("%s free=%u", __get_str(name), __entry->free)
+);
+
+DEFINE_EVENT(mcba_usb_queue, mcba_usb_queue_stop,
+	TP_PROTO(const struct net_device *netdev, unsigned int free),
+	TP_ARGS(netdev, free)
+);
+
+DEFINE_EVENT(mcba_usb_queue, mcba_usb_queue_wake,
+	TP_PROTO(const struct net_device *netdev, unsigned int free),
+	TP_ARGS(netdev, free)
+);
+
+#endif /* _MCBA_USB_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mcba_usb_trace
+#include <trace/define_trace.h>
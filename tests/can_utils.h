@@ -0,0 +1,128 @@
+#ifndef CAN_UTILS_H
+#define CAN_UTILS_H
+
+/* SocketCAN helpers shared by the test and benchmark programs */
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+inline int openCANSocket(const char *canName)
+{
+    int s;
+    struct ifreq ifr;
+    struct sockaddr_can addr;
+
+    if((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+        perror("Error while opening socket");
+        return -1;
+    }
+
+    strncpy(ifr.ifr_name, canName, IFNAMSIZ - 1);
+    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+    ifr.ifr_ifindex = if_nametoindex(ifr.ifr_name);
+
+    if (!ifr.ifr_ifindex) {
+        perror("if_nametoindex");
+        return 1;
+    }
+
+    ioctl(s, SIOCGIFINDEX, &ifr);
+
+    addr.can_family  = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error in socket bind");
+        return -2;
+    }
+
+    return s;
+}
+
+inline void configureCAN(const char *canName, int speed)
+{
+    char buff[100];
+
+    sprintf(buff, "sudo ip link set %s down", canName);
+    EXPECT_EQ(0, system(buff));
+
+    sprintf(buff, "sudo ip link set %s type can bitrate %d", canName, speed);
+    EXPECT_EQ(0, system(buff));
+
+    sprintf(buff, "sudo ip link set %s up && sleep 1", canName);
+    EXPECT_EQ(0, system(buff));
+}
+
+/* frames moved per sendmmsg/recvmmsg call */
+#define CAN_BATCH_MAX 64
+
+/* Send up to CAN_BATCH_MAX frames with one syscall. Returns the number of
+ * frames sent, which may be short when the TX queue fills up (errno is
+ * then ENOBUFS), or -1 on error.
+ */
+inline int writeCANBatch(int canFd, const struct can_frame *frames,
+                         unsigned int cnt)
+{
+    struct mmsghdr msgs[CAN_BATCH_MAX];
+    struct iovec iovs[CAN_BATCH_MAX];
+
+    if (cnt > CAN_BATCH_MAX)
+        cnt = CAN_BATCH_MAX;
+
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+
+    for (unsigned int i = 0; i < cnt; ++i)
+    {
+        iovs[i].iov_base = (void *)&frames[i];
+        iovs[i].iov_len = sizeof(struct can_frame);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return sendmmsg(canFd, msgs, cnt, 0);
+}
+
+/* Wait up to timeoutMs for frames, then read all queued ones (at most cnt,
+ * capped to CAN_BATCH_MAX) with one syscall. Returns the number of frames
+ * read, 0 on timeout or -1 on error.
+ */
+inline int readCANBatch(int canFd, struct can_frame *frames, unsigned int cnt,
+                        int timeoutMs)
+{
+    struct mmsghdr msgs[CAN_BATCH_MAX];
+    struct iovec iovs[CAN_BATCH_MAX];
+    struct pollfd pfd = { canFd, POLLIN, 0 };
+    int ret;
+
+    ret = poll(&pfd, 1, timeoutMs);
+    if (ret <= 0)
+        return ret;
+
+    if (cnt > CAN_BATCH_MAX)
+        cnt = CAN_BATCH_MAX;
+
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+
+    for (unsigned int i = 0; i < cnt; ++i)
+    {
+        iovs[i].iov_base = &frames[i];
+        iovs[i].iov_len = sizeof(struct can_frame);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return recvmmsg(canFd, msgs, cnt, MSG_DONTWAIT, NULL);
+}
+
+#endif // CAN_UTILS_H
@@ -0,0 +1,308 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "can_utils.h"
+
+/***********************************************
+ *
+ *  can0 - Microchip CAN BUS Analyzer
+ *  can1 - Other SocketCAN
+ *
+ *  Frames are sent back to back at full wire rate, batched with
+ *  sendmmsg/recvmmsg so the harness is not limited by syscalls. Each
+ *  frame carries its sequence number (data[0..3]) and send time in us
+ *  (data[4..7]), so both ends only need the host clock to measure
+ *  latency.
+ *
+ *  Usage: mcba_bench [gtest options] [--out=<file.json|file.csv>]
+ *         [--frames=<n>]
+ *
+ ***********************************************/
+
+#define BENCH_CAN_ID          0x123
+#define BENCH_RX_TIMEOUT_MS   500
+
+/* SFF frame with 8 data bytes, without stuff bits (lower bound) */
+#define BENCH_FRAME_BITS      (44 + 64 + 3)
+
+static const int bitrates[] = {20000, 33333, 50000, 80000, 83333, 100000,
+                               125000, 150000, 175000, 200000, 225000, 250000,
+                               275000, 300000, 500000, 625000, 800000, 1000000};
+
+static unsigned int benchFrames = 10000;
+static std::string benchOut;
+
+struct BenchResult
+{
+    std::string direction;
+    int bitrate;
+    unsigned int sent;
+    unsigned int received;
+    unsigned int lost;
+    unsigned int outOfOrder;
+    double fps;
+    double busLoad;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+};
+
+static std::vector<BenchResult> results;
+
+static uint32_t nowUs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void putLe32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t getLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+struct RxStats
+{
+    unsigned int received;
+    unsigned int outOfOrder;
+    uint32_t firstUs;
+    uint32_t lastUs;
+    std::vector<uint32_t> latency;
+};
+
+int benchWriteThread(const char *ifname, unsigned int cnt)
+{
+    int canFd = openCANSocket(ifname);
+    struct can_frame frames[CAN_BATCH_MAX];
+    unsigned int i = 0;
+
+    memset(frames, 0, sizeof(frames));
+
+    while (i < cnt)
+    {
+        unsigned int n = std::min(cnt - i, (unsigned int)CAN_BATCH_MAX);
+        uint32_t now = nowUs();
+
+        for (unsigned int j = 0; j < n; ++j)
+        {
+            frames[j].can_id = BENCH_CAN_ID;
+            frames[j].can_dlc = 8;
+            putLe32(&frames[j].data[0], i + j);
+            putLe32(&frames[j].data[4], now);
+        }
+
+        int ret = writeCANBatch(canFd, frames, n);
+        if (ret > 0)
+            i += ret;
+
+        if (ret == (int)n)
+            continue;
+
+        /* TX queue full, wait instead of spinning */
+        if (ret < 0 && errno != ENOBUFS && errno != EAGAIN)
+            break;
+
+        struct pollfd pfd = { canFd, POLLOUT, 0 };
+        poll(&pfd, 1, 1);
+    }
+
+    close(canFd);
+
+    return i;
+}
+
+RxStats benchReadThread(const char *ifname)
+{
+    int canFd = openCANSocket(ifname);
+    struct can_frame frames[CAN_BATCH_MAX];
+    RxStats st = {0, 0, 0, 0, {}};
+    uint32_t nextSeq = 0;
+    int n;
+
+    st.latency.reserve(benchFrames);
+
+    while ((n = readCANBatch(canFd, frames, CAN_BATCH_MAX,
+                             BENCH_RX_TIMEOUT_MS)) > 0)
+    {
+        /* frames of one batch share the receive time */
+        uint32_t now = nowUs();
+
+        if (!st.received)
+            st.firstUs = now;
+        st.lastUs = now;
+
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t seq = getLe32(&frames[i].data[0]);
+
+            if (seq < nextSeq)
+                st.outOfOrder++;
+            else
+                nextSeq = seq + 1;
+
+            st.latency.push_back(now - getLe32(&frames[i].data[4]));
+        }
+
+        st.received += n;
+    }
+
+    close(canFd);
+
+    return st;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+static void runBench(const char *direction, const char *sender,
+                     const char *receiver)
+{
+    for (int bitrate : bitrates)
+    {
+        configureCAN("can0", bitrate);
+        configureCAN("can1", bitrate);
+
+        std::future<RxStats> readRet = std::async(std::launch::async,
+                                                  &benchReadThread, receiver);
+        /* let the reader bind before the first frame goes out */
+        usleep(100000);
+        std::future<int> writeRet = std::async(std::launch::async,
+                                               &benchWriteThread, sender,
+                                               benchFrames);
+
+        BenchResult r;
+        unsigned int sent = writeRet.get();
+        RxStats st = readRet.get();
+
+        std::sort(st.latency.begin(), st.latency.end());
+
+        r.direction = direction;
+        r.bitrate = bitrate;
+        r.sent = sent;
+        r.received = st.received;
+        r.lost = sent > st.received ? sent - st.received : 0;
+        r.outOfOrder = st.outOfOrder;
+        r.fps = st.received > 1 && st.lastUs != st.firstUs ?
+                (st.received - 1) * 1e6 / (st.lastUs - st.firstUs) : 0;
+        r.busLoad = r.fps * BENCH_FRAME_BITS * 100.0 / bitrate;
+        r.p50 = percentile(st.latency, 0.5);
+        r.p99 = percentile(st.latency, 0.99);
+        r.p999 = percentile(st.latency, 0.999);
+
+        printf("%s %7d bit/s: %8.1f fps, load %5.1f%%, lost %u, ooo %u, "
+               "latency p50/p99/p999 %u/%u/%u us\n",
+               direction, bitrate, r.fps, r.busLoad, r.lost, r.outOfOrder,
+               r.p50, r.p99, r.p999);
+
+        EXPECT_EQ(benchFrames, sent);
+
+        results.push_back(r);
+    }
+
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+    EXPECT_EQ(0, system("sudo ip link set can1 down"));
+}
+
+TEST(benchmark, snd)
+{
+    runBench("snd", "can0", "can1");
+}
+
+TEST(benchmark, rcv)
+{
+    runBench("rcv", "can1", "can0");
+}
+
+static void writeCsv(FILE *f)
+{
+    fprintf(f, "direction,bitrate,sent,received,lost,out_of_order,fps,"
+               "bus_load_pct,lat_p50_us,lat_p99_us,lat_p999_us\n");
+
+    for (const BenchResult &r : results)
+        fprintf(f, "%s,%d,%u,%u,%u,%u,%.1f,%.2f,%u,%u,%u\n",
+                r.direction.c_str(), r.bitrate, r.sent, r.received, r.lost,
+                r.outOfOrder, r.fps, r.busLoad, r.p50, r.p99, r.p999);
+}
+
+static void writeJson(FILE *f)
+{
+    fprintf(f, "[\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &r = results[i];
+
+        fprintf(f, "  {\"direction\": \"%s\", \"bitrate\": %d, "
+                   "\"sent\": %u, \"received\": %u, \"lost\": %u, "
+                   "\"out_of_order\": %u, \"fps\": %.1f, "
+                   "\"bus_load_pct\": %.2f, \"lat_p50_us\": %u, "
+                   "\"lat_p99_us\": %u, \"lat_p999_us\": %u}%s\n",
+                r.direction.c_str(), r.bitrate, r.sent, r.received, r.lost,
+                r.outOfOrder, r.fps, r.busLoad, r.p50, r.p99, r.p999,
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(f, "]\n");
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg.compare(0, 6, "--out=") == 0)
+            benchOut = arg.substr(6);
+        else if (arg.compare(0, 9, "--frames=") == 0)
+            benchFrames = strtoul(arg.c_str() + 9, NULL, 0);
+    }
+
+    int ret = RUN_ALL_TESTS();
+
+    if (benchOut.empty())
+    {
+        writeCsv(stdout);
+        return ret;
+    }
+
+    FILE *f = fopen(benchOut.c_str(), "w");
+    if (!f)
+    {
+        perror(benchOut.c_str());
+        return 1;
+    }
+
+    size_t len = benchOut.size();
+    if (len > 4 && benchOut.compare(len - 4, 4, ".csv") == 0)
+        writeCsv(f);
+    else
+        writeJson(f);
+
+    fclose(f);
+
+    return ret;
+}
@@ -0,0 +1,321 @@
+#include <benchmark/benchmark.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../mcba_usb_proto.h"
+
+/***********************************************
+ *
+ *  Host side microbenchmarks of mcba_usb_proto.h, the message encoding
+ *  and RX parsing code of the driver. No hardware needed.
+ *
+ *  --replay=<file> also feeds captured RX transfers through the parser.
+ *  Files ending in .txt hold one transfer per line in hex (bytes may be
+ *  separated by ':' or spaces), as written by
+ *    tshark -r usb.pcapng -Y 'usb.endpoint_address == 0x81' \
+ *           -T fields -e usb.capdata
+ *  Other files are raw transfers of --transfer-size bytes (default 64).
+ *
+ *  Usage: mcba_codec_bench [benchmark options] [--replay=<file>]
+ *         [--transfer-size=<bytes>]
+ *
+ ***********************************************/
+
+#define BENCH_FRAMES     1024
+
+static size_t transferSize = 64;
+static std::vector<std::vector<uint8_t>> replay;
+
+/* SocketCAN frames with IDs spread over the whole range */
+static std::vector<struct can_frame> makeFrames(bool eff)
+{
+    std::vector<struct can_frame> frames(BENCH_FRAMES);
+    uint32_t id = 0x12345;
+
+    for (unsigned int i = 0; i < BENCH_FRAMES; i++)
+    {
+        id = id * 1103515245 + 12345;
+
+        frames[i].can_id = eff ? (id & CAN_EFF_MASK) | MCBA_CAN_EXID_MASK :
+                                 id & CAN_SFF_MASK;
+        frames[i].can_dlc = i % 9;
+        memset(frames[i].data, i, sizeof(frames[i].data));
+    }
+
+    return frames;
+}
+
+/* RECEIVE_MESSAGE records as the device sends them, back to back */
+static std::vector<uint8_t> makeStream(bool eff)
+{
+    std::vector<uint8_t> stream;
+
+    for (const struct can_frame &cf : makeFrames(eff))
+    {
+        mcba_usb_msg_can msg;
+
+        memset(&msg, 0, sizeof(msg));
+        mcba_usb_encode_can(&msg, cf.can_id, cf.can_dlc, cf.data);
+        msg.cmd_id = MBCA_CMD_RECEIVE_MESSAGE;
+
+        const uint8_t *p = (const uint8_t *)&msg;
+        for (size_t i = 0; i < offsetof(mcba_usb_msg_can, checksum); i++)
+            msg.checksum += p[i];
+
+        stream.insert(stream.end(), p, p + sizeof(msg));
+    }
+
+    return stream;
+}
+
+static void BM_Encode(benchmark::State &state)
+{
+    std::vector<struct can_frame> frames = makeFrames(state.range(0));
+    mcba_usb_msg_can msg;
+
+    for (auto _ : state)
+    {
+        for (const struct can_frame &cf : frames)
+        {
+            mcba_usb_encode_can(&msg, cf.can_id, cf.can_dlc, cf.data);
+            benchmark::DoNotOptimize(msg);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * frames.size());
+}
+BENCHMARK(BM_Encode)->ArgName("eff")->Arg(0)->Arg(1);
+
+/* What mcba_usb_process_can() takes from a record */
+static inline void decode(const mcba_usb_msg_can *msg, struct can_frame *cf)
+{
+    cf->can_id = mcba_usb_decode_id(msg);
+    if (MCBA_RX_IS_RTR(msg))
+        cf->can_id |= MCBA_CAN_RTR_MASK;
+    cf->can_dlc = msg->dlc & MCBA_DLC_MASK;
+    memcpy(cf->data, msg->data, sizeof(cf->data));
+}
+
+static void BM_Decode(benchmark::State &state)
+{
+    std::vector<uint8_t> stream = makeStream(state.range(0));
+    const mcba_usb_msg_can *msgs = (const mcba_usb_msg_can *)stream.data();
+    struct can_frame cf;
+
+    for (auto _ : state)
+    {
+        for (unsigned int i = 0; i < BENCH_FRAMES; i++)
+        {
+            decode(&msgs[i], &cf);
+            benchmark::DoNotOptimize(cf);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * BENCH_FRAMES);
+}
+BENCHMARK(BM_Decode)->ArgName("eff")->Arg(0)->Arg(1);
+
+struct ParseStats
+{
+    unsigned long records;
+    unsigned long formatErrors;
+    unsigned long byCmd[256];
+    struct can_frame cf;
+};
+
+static void parseRecord(void *ctx, struct mcba_usb_msg *msg)
+{
+    ParseStats *st = static_cast<ParseStats *>(ctx);
+
+    st->records++;
+    st->byCmd[msg->cmd_id]++;
+
+    if (msg->cmd_id == MBCA_CMD_RECEIVE_MESSAGE)
+        decode((const mcba_usb_msg_can *)msg, &st->cf);
+}
+
+static void parseLostSync(void *ctx, u8 /* cmd_id */)
+{
+    static_cast<ParseStats *>(ctx)->formatErrors++;
+}
+
+static void parseTransfers(const std::vector<std::vector<uint8_t>> &xfers,
+                           bool csum, ParseStats *st)
+{
+    struct mcba_usb_rx_parser parser;
+
+    memset(&parser, 0, sizeof(parser));
+
+    for (const std::vector<uint8_t> &xfer : xfers)
+        mcba_usb_rx_parse(&parser, (u8 *)xfer.data(), xfer.size(), csum,
+                          parseRecord, parseLostSync, st);
+}
+
+/* The stream cut into transfers of range(0) bytes, like the URBs see it */
+static void BM_Parse(benchmark::State &state)
+{
+    std::vector<uint8_t> stream = makeStream(false);
+    std::vector<std::vector<uint8_t>> xfers;
+    ParseStats st;
+
+    for (size_t pos = 0; pos < stream.size(); pos += state.range(0))
+        xfers.emplace_back(stream.begin() + pos,
+                           stream.begin() + std::min(stream.size(),
+                                                     pos + state.range(0)));
+
+    memset(&st, 0, sizeof(st));
+
+    for (auto _ : state)
+    {
+        parseTransfers(xfers, state.range(1), &st);
+        benchmark::DoNotOptimize(st);
+    }
+
+    state.SetItemsProcessed(state.iterations() * BENCH_FRAMES);
+    state.SetBytesProcessed(state.iterations() * stream.size());
+}
+BENCHMARK(BM_Parse)->ArgNames({"xfer", "csum"})
+    ->Args({64, 0})->Args({64, 1})->Args({512, 0});
+
+static void BM_Replay(benchmark::State &state)
+{
+    ParseStats st;
+    size_t bytes = 0;
+
+    for (const std::vector<uint8_t> &xfer : replay)
+        bytes += xfer.size();
+
+    memset(&st, 0, sizeof(st));
+
+    for (auto _ : state)
+    {
+        st.records = 0;
+        parseTransfers(replay, state.range(0), &st);
+        benchmark::DoNotOptimize(st);
+    }
+
+    state.SetItemsProcessed(state.iterations() * st.records);
+    state.SetBytesProcessed(state.iterations() * bytes);
+    state.counters["transfers"] = replay.size();
+}
+
+static void loadHex(FILE *f)
+{
+    char line[4096];
+
+    while (fgets(line, sizeof(line), f))
+    {
+        std::vector<uint8_t> xfer;
+        int nibble = -1;
+
+        for (char *p = line; *p; p++)
+        {
+            if (!isxdigit((unsigned char)*p))
+                continue;
+
+            int v = isdigit((unsigned char)*p) ? *p - '0' :
+                                                 tolower(*p) - 'a' + 10;
+
+            if (nibble < 0)
+            {
+                nibble = v;
+                continue;
+            }
+
+            xfer.push_back(nibble << 4 | v);
+            nibble = -1;
+        }
+
+        if (!xfer.empty())
+            replay.push_back(xfer);
+    }
+}
+
+static void loadRaw(FILE *f)
+{
+    std::vector<uint8_t> xfer(transferSize);
+    size_t n;
+
+    while ((n = fread(xfer.data(), 1, transferSize, f)) > 0)
+        replay.emplace_back(xfer.begin(), xfer.begin() + n);
+}
+
+static bool loadReplay(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+
+    if (!f)
+    {
+        perror(path.c_str());
+        return false;
+    }
+
+    size_t len = path.size();
+    if (len > 4 && path.compare(len - 4, 4, ".txt") == 0)
+        loadHex(f);
+    else
+        loadRaw(f);
+
+    fclose(f);
+
+    return true;
+}
+
+/* What the driver would have made of the capture */
+static void printReplay()
+{
+    ParseStats st;
+
+    memset(&st, 0, sizeof(st));
+    parseTransfers(replay, false, &st);
+
+    printf("replay: %zu transfers, %lu records, %lu format errors\n",
+           replay.size(), st.records, st.formatErrors);
+
+    for (int i = 0; i < 256; i++)
+        if (st.byCmd[i])
+            printf("  cmd 0x%02x: %lu\n", i, st.byCmd[i]);
+}
+
+int main(int argc, char **argv)
+{
+    std::string replayPath;
+    int n = 1;
+
+    /* ours are taken out, the rest is for the benchmark library */
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg.compare(0, 9, "--replay=") == 0)
+            replayPath = arg.substr(9);
+        else if (arg.compare(0, 16, "--transfer-size=") == 0)
+            transferSize = std::max(1UL, strtoul(arg.c_str() + 16, NULL, 0));
+        else
+            argv[n++] = argv[i];
+    }
+    argc = n;
+
+    if (!replayPath.empty())
+    {
+        if (!loadReplay(replayPath))
+            return 1;
+
+        printReplay();
+        benchmark::RegisterBenchmark("BM_Replay", BM_Replay)
+            ->ArgName("csum")->Arg(0)->Arg(1);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../mcba_usb_proto.h"
+
+/***********************************************
+ *
+ *  Host side tests of mcba_usb_proto.h, the message encoding and RX
+ *  parsing code of the driver. No hardware needed.
+ *
+ ***********************************************/
+
+/* Frames are built with the bit macros, decoded with the driver code */
+TEST(canIDConvertion, standardId)
+{
+    uint32_t canIdConverted = 0;
+    mcba_usb_msg_can usb_msg;
+    struct can_frame cf;
+
+    for(uint32_t i = 1; i < 2048; ++i)
+    {
+	cf.can_id = i;
+
+	usb_msg.sidl = MCBA_SET_S_SIDL(cf.can_id);
+	usb_msg.sidh = MCBA_SET_S_SIDH(cf.can_id);
+	usb_msg.eidl = 0;
+	usb_msg.eidh = 0;
+
+	canIdConverted = mcba_usb_decode_id(&usb_msg);
+
+	EXPECT_EQ(cf.can_id, canIdConverted);
+    }
+}
+
+TEST(canIDConvertion, standardIdRTR)
+{
+    uint32_t canIdConverted = 0;
+    mcba_usb_msg_can usb_msg;
+    struct can_frame cf;
+
+    for(uint32_t i = 1; i < 2048; ++i)
+    {
+	cf.can_id = i | MCBA_CAN_RTR_MASK;
+
+	usb_msg.sidl = MCBA_SET_S_SIDL(cf.can_id);
+	usb_msg.sidh = MCBA_SET_S_SIDH(cf.can_id);
+	usb_msg.eidl = 0;
+	usb_msg.eidh = 0;
+	usb_msg.dlc = MCBA_DLC_RTR_MASK;
+
+	canIdConverted = mcba_usb_decode_id(&usb_msg);
+
+	if(MCBA_RX_IS_RTR((&usb_msg)))
+	    canIdConverted |= MCBA_CAN_RTR_MASK;
+
+	EXPECT_EQ(cf.can_id, canIdConverted);
+    }
+}
+
+TEST(canIDConvertion, extendedId)
+{
+    uint32_t canIdConverted = 0;
+    mcba_usb_msg_can usb_msg;
+    struct can_frame cf;
+
+    for(uint32_t i = 1; i < 0x20000000; ++i)
+    {
+	cf.can_id = i | MCBA_CAN_EXID_MASK;
+
+	usb_msg.sidl = MCBA_SET_E_SIDL(cf.can_id);
+	usb_msg.sidh = MCBA_SET_E_SIDH(cf.can_id);
+	usb_msg.eidl = MCBA_SET_EIDL(cf.can_id);
+	usb_msg.eidh = MCBA_SET_EIDH(cf.can_id);
+
+	canIdConverted = mcba_usb_decode_id(&usb_msg);
+
+	if(MCBA_RX_IS_EXID((&usb_msg)))
+	    canIdConverted |= MCBA_CAN_EXID_MASK;
+
+	EXPECT_EQ(cf.can_id, canIdConverted);
+    }
+}
+
+TEST(canIDConvertion, extendedIdRTR)
+{
+    uint32_t canIdConverted = 0;
+    mcba_usb_msg_can usb_msg;
+    struct can_frame cf;
+
+    for(uint32_t i = 1; i < 0x20000000; ++i)
+    {
+	cf.can_id = i | MCBA_CAN_RTR_MASK | MCBA_CAN_EXID_MASK;
+
+	usb_msg.sidl = MCBA_SET_E_SIDL(cf.can_id);
+	usb_msg.sidh = MCBA_SET_E_SIDH(cf.can_id);
+	usb_msg.eidl = MCBA_SET_EIDL(cf.can_id);
+	usb_msg.eidh = MCBA_SET_EIDH(cf.can_id);
+	usb_msg.dlc = MCBA_DLC_RTR_MASK;
+
+	canIdConverted = mcba_usb_decode_id(&usb_msg);
+
+	if(MCBA_RX_IS_EXID((&usb_msg)))
+	    canIdConverted |= MCBA_CAN_EXID_MASK;
+
+	if(MCBA_RX_IS_RTR((&usb_msg)))
+	    canIdConverted |= MCBA_CAN_RTR_MASK;
+
+	EXPECT_EQ(cf.can_id, canIdConverted);
+    }
+}
+
+TEST(canEncode, frame)
+{
+    const uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    mcba_usb_msg_can usb_msg;
+
+    mcba_usb_encode_can(&usb_msg, 0x1abcdef | MCBA_CAN_EXID_MASK |
+                        MCBA_CAN_RTR_MASK, 5, data);
+
+    EXPECT_EQ(MBCA_CMD_TRANSMIT_MESSAGE_EV, usb_msg.cmd_id);
+    EXPECT_EQ(0x1abcdef | MCBA_CAN_EXID_MASK, mcba_usb_decode_id(&usb_msg));
+    EXPECT_EQ(5 | MCBA_DLC_RTR_MASK, usb_msg.dlc);
+    EXPECT_EQ(0, memcmp(data, usb_msg.data, sizeof(data)));
+
+    mcba_usb_encode_can(&usb_msg, 0x7ff, 8, data);
+
+    EXPECT_EQ(0x7ffu, mcba_usb_decode_id(&usb_msg));
+    EXPECT_EQ(8, usb_msg.dlc);
+}
+
+/* Collects what mcba_usb_rx_parse() reports */
+struct ParseLog
+{
+    std::vector<mcba_usb_msg> records;
+    unsigned int lostSync;
+};
+
+static void logRecord(void *ctx, struct mcba_usb_msg *msg)
+{
+    static_cast<ParseLog *>(ctx)->records.push_back(*msg);
+}
+
+static void logLostSync(void *ctx, u8 /* cmd_id */)
+{
+    static_cast<ParseLog *>(ctx)->lostSync++;
+}
+
+/* CAN record with sequence number seq in data[0] and a good checksum */
+static void putRecord(std::vector<uint8_t> &stream, uint8_t seq)
+{
+    const uint8_t data[8] = {seq};
+    mcba_usb_msg_can msg;
+
+    memset(&msg, 0, sizeof(msg));
+    mcba_usb_encode_can(&msg, 0x100 + seq, 8, data);
+    msg.cmd_id = MBCA_CMD_RECEIVE_MESSAGE;
+
+    const uint8_t *p = (const uint8_t *)&msg;
+    for (size_t i = 0; i < offsetof(mcba_usb_msg_can, checksum); i++)
+        msg.checksum += p[i];
+
+    stream.insert(stream.end(), p, p + sizeof(msg));
+}
+
+/* Feed the stream in transfers of chunk bytes */
+static ParseLog parse(std::vector<uint8_t> stream, size_t chunk, bool csum)
+{
+    struct mcba_usb_rx_parser parser;
+    ParseLog log = {{}, 0};
+
+    memset(&parser, 0, sizeof(parser));
+
+    for (size_t pos = 0; pos < stream.size(); pos += chunk)
+        mcba_usb_rx_parse(&parser, stream.data() + pos,
+                          std::min(chunk, stream.size() - pos), csum,
+                          logRecord, logLostSync, &log);
+
+    return log;
+}
+
+static void expectSequence(const ParseLog &log, unsigned int first,
+                           unsigned int cnt)
+{
+    ASSERT_EQ(cnt, log.records.size());
+
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        const mcba_usb_msg_can *msg =
+            (const mcba_usb_msg_can *)&log.records[i];
+
+        EXPECT_EQ(MBCA_CMD_RECEIVE_MESSAGE, msg->cmd_id);
+        EXPECT_EQ(first + i, msg->data[0]);
+        EXPECT_EQ(0x100 + first + i, mcba_usb_decode_id(msg));
+    }
+}
+
+TEST(rxParse, stacked)
+{
+    std::vector<uint8_t> stream;
+
+    for (int i = 0; i < 3; i++)
+        putRecord(stream, i);
+
+    ParseLog log = parse(stream, 64, false);
+
+    expectSequence(log, 0, 3);
+    EXPECT_EQ(0u, log.lostSync);
+}
+
+/* Records straddle transfers for any transfer size */
+TEST(rxParse, split)
+{
+    std::vector<uint8_t> stream;
+
+    for (int i = 0; i < 100; i++)
+        putRecord(stream, i);
+
+    for (size_t chunk = 1; chunk <= 128; chunk++)
+    {
+        ParseLog log = parse(stream, chunk, false);
+
+        expectSequence(log, 0, 100);
+        EXPECT_EQ(0u, log.lostSync) << "chunk " << chunk;
+    }
+}
+
+/* One run of garbage is one format error, the stream recovers after it */
+TEST(rxParse, resync)
+{
+    std::vector<uint8_t> stream;
+
+    putRecord(stream, 0);
+    stream.insert(stream.end(), {0x00, 0x11, 0x22, 0x33, 0x44});
+    putRecord(stream, 1);
+    putRecord(stream, 2);
+
+    ParseLog log = parse(stream, 64, false);
+
+    expectSequence(log, 0, 3);
+    EXPECT_EQ(1u, log.lostSync);
+}
+
+/* A known cmd_id inside garbage is only trusted with a good checksum */
+TEST(rxParse, resyncCsum)
+{
+    std::vector<uint8_t> stream;
+
+    stream.push_back(0x00);
+    stream.push_back(MBCA_CMD_RECEIVE_MESSAGE);
+    stream.insert(stream.end(), MCBA_USB_MSG_SIZE - 1, 0x55);
+    putRecord(stream, 0);
+
+    ParseLog log = parse(stream, 64, true);
+
+    expectSequence(log, 0, 1);
+    EXPECT_EQ(1u, log.lostSync);
+
+    /* without the checksum, the fake record is taken */
+    log = parse(stream, 64, false);
+
+    EXPECT_EQ(1u, log.lostSync);
+    EXPECT_LT(1u, log.records.size());
+}
+
+/* A fragment turning out to be junk makes the next transfer rescanned */
+TEST(rxParse, junkFragment)
+{
+    /* transfer 1: garbage, ending in what looks like a partial record */
+    std::vector<uint8_t> stream(57, 0x00);
+
+    stream.push_back(MBCA_CMD_RECEIVE_MESSAGE);
+    stream.insert(stream.end(), 6, 0x55);
+
+    /* transfer 2: whole records */
+    putRecord(stream, 0);
+    putRecord(stream, 1);
+
+    ParseLog log = parse(stream, 64, true);
+
+    expectSequence(log, 0, 2);
+    EXPECT_EQ(1u, log.lostSync);
+}
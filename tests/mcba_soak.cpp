@@ -0,0 +1,443 @@
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "can_utils.h"
+
+/***********************************************
+ *
+ *  can0 - Microchip CAN BUS Analyzer
+ *  can1 - Other SocketCAN
+ *
+ *  Sends paced traffic at a fixed bus load for a long time and samples
+ *  throughput, loss and kernel memory every interval. Each frame carries
+ *  its sequence number (data[0..3]), so lost frames are counted as they
+ *  happen. Driver faults can be injected meanwhile through the fail_*
+ *  knobs in /sys/kernel/debug/mcba_usb/ (CONFIG_FAULT_INJECTION_DEBUG_FS).
+ *
+ *  Usage: mcba_soak [gtest options] [--duration=<s>] [--interval=<s>]
+ *         [--bitrate=<bit/s>] [--load=<%>] [--max-drift=<%>]
+ *         [--fault=<fail_urb_submit|fail_urb_complete|fail_alloc>,<%>]...
+ *         [--out=<file.csv>]
+ *
+ ***********************************************/
+
+#define SOAK_CAN_ID          0x321
+#define SOAK_RX_TIMEOUT_MS   500
+#define SOAK_FAULT_DIR       "/sys/kernel/debug/mcba_usb/"
+
+/* SFF frame with 8 data bytes, without stuff bits (lower bound) */
+#define SOAK_FRAME_BITS      (44 + 64 + 3)
+
+static unsigned int soakDuration = 600;
+static unsigned int soakInterval = 10;
+static int soakBitrate = 500000;
+static unsigned int soakLoad = 50;
+static double soakMaxDrift = 5.0;
+static std::vector<std::pair<std::string, unsigned int>> soakFaults;
+static std::string soakOut;
+
+/* URBs come from kmalloc, every frame costs an skb head */
+static const char *const soakSlabs[] = {"kmalloc-192", "kmalloc-256",
+                                        "skbuff_head_cache"};
+
+struct SoakSample
+{
+    std::string direction;
+    unsigned int t;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long lost;
+    double fps;
+    double drift;
+    long coherent;
+    std::map<std::string, long> slabs;
+};
+
+static std::vector<SoakSample> samples;
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void putLe32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t getLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Active objects of the watched caches, -1 if not found (merged by SLUB) */
+static std::map<std::string, long> readSlabs()
+{
+    std::map<std::string, long> slabs;
+    char line[512];
+
+    for (const char *name : soakSlabs)
+        slabs[name] = -1;
+
+    FILE *f = popen("sudo cat /proc/slabinfo", "r");
+    if (!f)
+        return slabs;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char name[64];
+        long active;
+
+        if (sscanf(line, "%63s %ld", name, &active) == 2 &&
+            slabs.count(name))
+            slabs[name] = active;
+    }
+
+    pclose(f);
+
+    return slabs;
+}
+
+/* USB buffers (usb_alloc_coherent) in use on the analyzer's host
+ * controller, from the "pools" file of the first parent device having one.
+ * They are preallocated by the driver, so this should not move.
+ */
+static long readCoherent(const char *ifname)
+{
+    char link[PATH_MAX];
+    std::string path = std::string("/sys/class/net/") + ifname + "/device";
+
+    if (!realpath(path.c_str(), link))
+        return -1;
+
+    for (path = link; path.size() > 1; path.erase(path.rfind('/')))
+    {
+        FILE *f = fopen((path + "/pools").c_str(), "r");
+        char line[256];
+        long inUse = 0;
+
+        if (!f)
+            continue;
+
+        while (fgets(line, sizeof(line), f))
+        {
+            char name[64];
+            long blocks;
+
+            if (sscanf(line, "%63s %ld", name, &blocks) == 2 &&
+                !strncmp(name, "buffer-", 7))
+                inUse += blocks;
+        }
+
+        fclose(f);
+
+        return inUse;
+    }
+
+    return -1;
+}
+
+static bool writeFault(const std::string &attr, const char *knob,
+                       const std::string &value)
+{
+    std::string cmd = "echo " + value + " | sudo tee " SOAK_FAULT_DIR +
+                      attr + "/" + knob + " > /dev/null";
+
+    return system(cmd.c_str()) == 0;
+}
+
+static void setFaults(bool enable)
+{
+    for (const auto &fault : soakFaults)
+    {
+        bool ok = writeFault(fault.first, "verbose", "0") &&
+                  writeFault(fault.first, "interval", "1") &&
+                  writeFault(fault.first, "times", "-1") &&
+                  writeFault(fault.first, "probability",
+                             std::to_string(enable ? fault.second : 0));
+
+        EXPECT_TRUE(ok) << SOAK_FAULT_DIR << fault.first
+                        << " missing, kernel without fault injection?";
+    }
+}
+
+struct SoakCounters
+{
+    std::atomic<unsigned long> sent;
+    std::atomic<unsigned long> received;
+    std::atomic<unsigned long> lost;
+    std::atomic<bool> stop;
+};
+
+/* Paced to fps, in batches of whatever is due */
+static void soakWriteThread(const char *ifname, double fps, SoakCounters *c)
+{
+    int canFd = openCANSocket(ifname);
+    struct can_frame frames[CAN_BATCH_MAX];
+    uint64_t start = nowUs();
+    unsigned long seq = 0;
+
+    memset(frames, 0, sizeof(frames));
+
+    while (!c->stop)
+    {
+        unsigned long due = (nowUs() - start) * fps / 1e6;
+
+        if (due <= seq)
+        {
+            usleep(500);
+            continue;
+        }
+
+        unsigned int n = std::min(due - seq, (unsigned long)CAN_BATCH_MAX);
+
+        for (unsigned int j = 0; j < n; ++j)
+        {
+            frames[j].can_id = SOAK_CAN_ID;
+            frames[j].can_dlc = 8;
+            putLe32(&frames[j].data[0], seq + j);
+        }
+
+        int ret = writeCANBatch(canFd, frames, n);
+        if (ret > 0)
+        {
+            seq += ret;
+            c->sent = seq;
+        }
+
+        if (ret == (int)n)
+            continue;
+
+        if (ret < 0 && errno != ENOBUFS && errno != EAGAIN)
+        {
+            perror("sendmmsg");
+            break;
+        }
+
+        struct pollfd pfd = { canFd, POLLOUT, 0 };
+        poll(&pfd, 1, 1);
+    }
+
+    close(canFd);
+}
+
+/* Runs until stopped and the bus went quiet */
+static void soakReadThread(const char *ifname, SoakCounters *c)
+{
+    int canFd = openCANSocket(ifname);
+    struct can_frame frames[CAN_BATCH_MAX];
+    uint32_t nextSeq = 0;
+    int n;
+
+    while ((n = readCANBatch(canFd, frames, CAN_BATCH_MAX,
+                             SOAK_RX_TIMEOUT_MS)) > 0 || !c->stop)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t seq = getLe32(&frames[i].data[0]);
+
+            /* reordered frames were already counted lost */
+            if (seq >= nextSeq)
+            {
+                c->lost += seq - nextSeq;
+                nextSeq = seq + 1;
+            }
+        }
+
+        if (n > 0)
+            c->received += n;
+    }
+
+    close(canFd);
+}
+
+static void runSoak(const char *direction, const char *sender,
+                    const char *receiver)
+{
+    double fps = soakBitrate * soakLoad / 100.0 / SOAK_FRAME_BITS;
+    SoakCounters c;
+
+    c.sent = 0;
+    c.received = 0;
+    c.lost = 0;
+    c.stop = false;
+
+    configureCAN("can0", soakBitrate);
+    configureCAN("can1", soakBitrate);
+    setFaults(true);
+
+    std::thread reader(soakReadThread, receiver, &c);
+    /* let the reader bind before the first frame goes out */
+    usleep(100000);
+    std::thread writer(soakWriteThread, sender, fps, &c);
+
+    uint64_t start = nowUs();
+    unsigned long lastReceived = 0;
+    double firstFps = 0;
+    double lastFps = 0;
+    double maxDrift = 0;
+
+    for (unsigned int t = soakInterval; t <= soakDuration; t += soakInterval)
+    {
+        uint64_t wake = start + t * 1000000ULL;
+        uint64_t now = nowUs();
+
+        if (wake > now)
+            usleep(wake - now);
+
+        SoakSample s;
+        unsigned long received = c.received;
+
+        s.direction = direction;
+        s.t = t;
+        s.sent = c.sent;
+        s.received = received;
+        s.lost = c.lost;
+        s.fps = (double)(received - lastReceived) / soakInterval;
+        s.coherent = readCoherent("can0");
+        s.slabs = readSlabs();
+
+        /* the first interval includes the ramp up, compare to the second */
+        if (t == 2 * soakInterval)
+            firstFps = s.fps;
+        s.drift = firstFps ? (s.fps - firstFps) * 100.0 / firstFps : 0;
+        if (t > 2 * soakInterval)
+            maxDrift = std::max(maxDrift, std::abs(s.drift));
+
+        printf("%s %6us: %9lu sent, %9lu received, %7lu lost, "
+               "%8.1f fps (%+5.1f%%), %ld USB buffers",
+               direction, t, s.sent, s.received, s.lost, s.fps, s.drift,
+               s.coherent);
+        for (const auto &slab : s.slabs)
+            printf(", %s %ld", slab.first.c_str(), slab.second);
+        printf("\n");
+
+        samples.push_back(s);
+        lastReceived = received;
+        lastFps = s.fps;
+    }
+
+    c.stop = true;
+    writer.join();
+    reader.join();
+
+    setFaults(false);
+
+    /* the driver counters tell which recovery paths ran */
+    EXPECT_EQ(0, system("ethtool -S can0"));
+
+    printf("%s total: %lu sent, %lu received, %lu lost, max drift %.1f%%\n",
+           direction, c.sent.load(), c.received.load(), c.lost.load(),
+           maxDrift);
+
+    /* injected faults lose frames, but must not stop the traffic */
+    if (soakFaults.empty())
+    {
+        EXPECT_EQ(c.sent, c.received);
+    }
+    EXPECT_GT(lastFps, 0);
+    EXPECT_LE(maxDrift, soakMaxDrift);
+
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+    EXPECT_EQ(0, system("sudo ip link set can1 down"));
+}
+
+TEST(soak, snd)
+{
+    runSoak("snd", "can0", "can1");
+}
+
+TEST(soak, rcv)
+{
+    runSoak("rcv", "can1", "can0");
+}
+
+static void writeCsv(FILE *f)
+{
+    fprintf(f, "direction,t_s,sent,received,lost,fps,drift_pct,"
+               "usb_buffers");
+    for (const char *name : soakSlabs)
+        fprintf(f, ",%s", name);
+    fprintf(f, "\n");
+
+    for (const SoakSample &s : samples)
+    {
+        fprintf(f, "%s,%u,%lu,%lu,%lu,%.1f,%.2f,%ld", s.direction.c_str(),
+                s.t, s.sent, s.received, s.lost, s.fps, s.drift, s.coherent);
+        for (const char *name : soakSlabs)
+            fprintf(f, ",%ld", s.slabs.at(name));
+        fprintf(f, "\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg.compare(0, 11, "--duration=") == 0)
+            soakDuration = strtoul(arg.c_str() + 11, NULL, 0);
+        else if (arg.compare(0, 11, "--interval=") == 0)
+            soakInterval = std::max(1UL, strtoul(arg.c_str() + 11, NULL, 0));
+        else if (arg.compare(0, 10, "--bitrate=") == 0)
+            soakBitrate = strtol(arg.c_str() + 10, NULL, 0);
+        else if (arg.compare(0, 7, "--load=") == 0)
+            soakLoad = std::min(100UL, strtoul(arg.c_str() + 7, NULL, 0));
+        else if (arg.compare(0, 12, "--max-drift=") == 0)
+            soakMaxDrift = strtod(arg.c_str() + 12, NULL);
+        else if (arg.compare(0, 8, "--fault=") == 0)
+        {
+            size_t comma = arg.find(',', 8);
+
+            if (comma == std::string::npos)
+            {
+                fprintf(stderr, "%s: expected <attr>,<%%>\n", arg.c_str());
+                return 1;
+            }
+
+            soakFaults.emplace_back(arg.substr(8, comma - 8),
+                                    strtoul(arg.c_str() + comma + 1, NULL, 0));
+        }
+        else if (arg.compare(0, 6, "--out=") == 0)
+            soakOut = arg.substr(6);
+    }
+
+    int ret = RUN_ALL_TESTS();
+
+    if (soakOut.empty())
+        return ret;
+
+    FILE *f = fopen(soakOut.c_str(), "w");
+    if (!f)
+    {
+        perror(soakOut.c_str());
+        return 1;
+    }
+
+    writeCsv(f);
+    fclose(f);
+
+    return ret;
+}
@@ -4,54 +4,21 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <glob.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <thread>
 #include <future>
+#include <chrono>
+#include <string>
+#include <vector>
 
-#define u8 uint8_t
-#define u32 uint32_t
-#define __packed
-#define netdev_tx_t void
-struct can_priv{};
-struct usb_anchor{};
-struct can_berr_counter{};
-
-#include "mcba_usb.h"
-
-int openCANSocket(const char *canName)
-{
-    int s;
-    struct ifreq ifr;
-    struct sockaddr_can addr;
-
-    if((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-        perror("Error while opening socket");
-        return -1;
-    }
-
-    strncpy(ifr.ifr_name, canName, IFNAMSIZ - 1);
-    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
-    ifr.ifr_ifindex = if_nametoindex(ifr.ifr_name);
-
-    if (!ifr.ifr_ifindex) {
-        perror("if_nametoindex");
-        return 1;
-    }
-
-    ioctl(s, SIOCGIFINDEX, &ifr);
-
-    addr.can_family  = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-
-    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("Error in socket bind");
-        return -2;
-    }
-
-    return s;
-}
+#include "can_utils.h"
+#include "../mcba_usb_proto.h"
+#include "../mcba_usb_capture.h"
 
 int writeCAN(int canFd, canid_t id, u8 dlc, ...)
 {
@@ -95,21 +62,6 @@ int readCAN(int canFd, struct can_frame *frame)
     return retval;
 }
 
-void configureCAN(const char *canName, int speed)
-{
-    char buff[100];
-
-    sprintf(buff, "sudo ip link set %s down", canName);
-    EXPECT_EQ(0, system(buff));
-
-    sprintf(buff, "sudo ip link set %s type can bitrate %d", canName, speed);
-    EXPECT_EQ(0, system(buff));
-
-    sprintf(buff, "sudo ip link set %s up && sleep 1", canName);
-    EXPECT_EQ(0, system(buff));
-}
-
-
 int getTermination(const char *interface)
 {
     FILE *f = 0;
@@ -146,6 +98,47 @@ void setTermination(const char *interface, char val)
     fclose(f);
 }
 
+// Retune through sysfs, the interface may stay up. Returns 0 on success.
+int setBitrate(const char *interface, int bitrate)
+{
+    FILE *f = 0;
+    char buff[100];
+    int ret;
+
+    sprintf(buff, "/sys/class/net/%s/bitrate", interface);
+
+    f = fopen(buff, "w");
+    EXPECT_NE((FILE *)0, f);
+    if (!f)
+        return -1;
+
+    // the write error only shows up on flush
+    ret = fprintf(f, "%d\n", bitrate) < 0;
+    ret |= fclose(f);
+
+    return ret;
+}
+
+int getBitrate(const char *interface)
+{
+    FILE *f = 0;
+    char buff[100];
+    int bitrate = -1;
+
+    sprintf(buff, "/sys/class/net/%s/bitrate", interface);
+
+    f = fopen(buff, "r");
+    EXPECT_NE((FILE *)0, f);
+    if (!f)
+        return -1;
+
+    EXPECT_EQ(1, fscanf(f, "%d", &bitrate));
+
+    fclose(f);
+
+    return bitrate;
+}
+
 int canReadThread(const char* ifname, u32 flags)
 {
     int canFd = 0;
@@ -206,7 +199,7 @@ int canWriteThread(const char* ifname, const int cnt, u32 flags)
 //    configureCAN(ifname, 1000000);
     canFd = openCANSocket(ifname);
 
-    for(i = 0; i <= cnt; ++i)
+    for(i = 0; i <= (canid_t)cnt; ++i)
     {
 	dataSent = writeCAN(canFd, i | flags, 8, 1, 2, 3, 4, 5, 6, 7, 8);
 
@@ -275,111 +268,197 @@ int canWriteThreadExt(const char* ifname, canid_t start, canid_t cnt, canid_t sh
     return i;
 }
 
-/***********************************************
- *
- *  can0 - Microchip CAN BUS Analyzer
- *  can1 - Other SocketCAN
- *
- ***********************************************/
+int canReadThreadBatch(const char* ifname, u32 flags)
+{
+    int canFd = 0;
+    can_frame frames[CAN_BATCH_MAX];
+    int retVal;
+    canid_t i = 0;
+
+    canFd = openCANSocket(ifname);
+
+    while((retVal = readCANBatch(canFd, frames, CAN_BATCH_MAX, 100)) > 0)
+    {
+        for(int j = 0; j < retVal; ++j)
+        {
+            EXPECT_EQ(i++ | flags, frames[j].can_id);
+        }
+    }
 
-TEST(canIDConvertion, standardId)
+    EXPECT_GE(retVal, 0);
+
+    close(canFd);
+
+    return i;
+}
+
+/* Back to back frames, no usleep() pacing */
+int canWriteThreadBatch(const char* ifname, const int cnt, u32 flags)
 {
-    uint32_t canIdConverted = 0;
-    mcba_usb_msg_can usb_msg;
-    struct can_frame cf;
+    int canFd = 0;
+    can_frame frames[CAN_BATCH_MAX];
+    canid_t i = 0;
+    int dataSent = 0;
 
-    for(uint32_t i = 1; i < 2048; ++i)
+    canFd = openCANSocket(ifname);
+
+    memset(frames, 0, sizeof(frames));
+
+    while(i <= (canid_t)cnt)
     {
-	cf.can_id = i;
+        int n = std::min(cnt + 1 - (int)i, CAN_BATCH_MAX);
 
-	usb_msg.sidl = MCBA_SET_S_SIDL(cf.can_id);
-	usb_msg.sidh = MCBA_SET_S_SIDH(cf.can_id);
-	usb_msg.eidl = 0;
-	usb_msg.eidh = 0;
+        for(int j = 0; j < n; ++j)
+        {
+            frames[j].can_id = (i + j) | flags;
+            frames[j].can_dlc = 8;
+        }
 
-	canIdConverted = MCBA_CAN_GET_SID((&usb_msg));
+        dataSent = writeCANBatch(canFd, frames, n);
 
-	EXPECT_EQ(cf.can_id, canIdConverted);
+        if(dataSent > 0)
+        {
+            i += dataSent;
+        }
+        else
+        {
+            // TX queue full
+            EXPECT_EQ(ENOBUFS, errno);
+            usleep(100);
+        }
     }
+
+    close(canFd);
+
+    return i;
 }
 
-TEST(canIDConvertion, standardIdRTR)
+/* Analyzers exercised by the stress_multi tests, from MCBA_DEVICES
+ * (e.g. MCBA_DEVICES=can0,can2,can3). Defaults to can0.
+ */
+std::vector<std::string> getMultiDevices()
 {
-    uint32_t canIdConverted = 0;
-    mcba_usb_msg_can usb_msg;
-    struct can_frame cf;
+    std::vector<std::string> devs;
+    const char *env = getenv("MCBA_DEVICES");
+    std::string list = env && *env ? env : "can0";
+    size_t pos = 0;
 
-    for(uint32_t i = 1; i < 2048; ++i)
+    while(pos <= list.size())
     {
-	cf.can_id = i | MCBA_CAN_RTR_MASK;
+        size_t end = list.find(',', pos);
 
-	usb_msg.sidl = MCBA_SET_S_SIDL(cf.can_id);
-	usb_msg.sidh = MCBA_SET_S_SIDH(cf.can_id);
-	usb_msg.eidl = 0;
-	usb_msg.eidh = 0;
-	usb_msg.dlc = MCBA_DLC_RTR_MASK;
+        if(end == std::string::npos)
+            end = list.size();
 
-	canIdConverted = MCBA_CAN_GET_SID((&usb_msg));
+        if(end > pos)
+            devs.push_back(list.substr(pos, end - pos));
 
-	if(MCBA_RX_IS_RTR((&usb_msg)))
-	    canIdConverted |= MCBA_CAN_RTR_MASK;
-
-	EXPECT_EQ(cf.can_id, canIdConverted);
+        pos = end + 1;
     }
+
+    return devs;
 }
 
-TEST(canIDConvertion, extendedId)
+/* device index in bits 16..23 of an EFF id, sequence in bits 0..15 */
+#define MULTI_DEV_SHIFT 16
+#define MULTI_SEQ_MASK  0xffff
+
+struct MultiRxStats
+{
+    unsigned int received;
+    unsigned int outOfOrder;
+    std::chrono::steady_clock::time_point first;
+    std::chrono::steady_clock::time_point last;
+};
+
+/* Counts frames per sending device on ifname, until 100ms of silence */
+std::vector<MultiRxStats> canReadThreadMulti(const char* ifname, size_t devCnt)
 {
-    uint32_t canIdConverted = 0;
-    mcba_usb_msg_can usb_msg;
-    struct can_frame cf;
+    int canFd = 0;
+    can_frame frames[CAN_BATCH_MAX];
+    std::vector<MultiRxStats> stats(devCnt, MultiRxStats{0, 0, {}, {}});
+    std::vector<canid_t> nextSeq(devCnt, 0);
+    int retVal;
 
-    for(uint32_t i = 1; i < 0x20000000; ++i)
+    canFd = openCANSocket(ifname);
+
+    while((retVal = readCANBatch(canFd, frames, CAN_BATCH_MAX, 100)) > 0)
     {
-	cf.can_id = i | MCBA_CAN_EXID_MASK;
+        auto now = std::chrono::steady_clock::now();
 
-	usb_msg.sidl = MCBA_SET_E_SIDL(cf.can_id);
-	usb_msg.sidh = MCBA_SET_E_SIDH(cf.can_id);
-	usb_msg.eidl = MCBA_SET_EIDL(cf.can_id);
-	usb_msg.eidh = MCBA_SET_EIDH(cf.can_id);
+        for(int j = 0; j < retVal; ++j)
+        {
+            canid_t id = frames[j].can_id & CAN_EFF_MASK;
+            size_t dev = id >> MULTI_DEV_SHIFT;
+            canid_t seq = id & MULTI_SEQ_MASK;
 
-	canIdConverted = MCBA_CAN_GET_EID((&usb_msg));
+            EXPECT_LT(dev, devCnt);
+            if(dev >= devCnt)
+                continue;
 
-	if(MCBA_RX_IS_EXID((&usb_msg)))
-	    canIdConverted |= MCBA_CAN_EXID_MASK;
+            MultiRxStats &st = stats[dev];
 
-	EXPECT_EQ(cf.can_id, canIdConverted);
+            if(!st.received)
+                st.first = now;
+            st.last = now;
+            st.received++;
+
+            if(seq != nextSeq[dev])
+                st.outOfOrder++;
+            nextSeq[dev] = seq + 1;
+        }
     }
+
+    EXPECT_GE(retVal, 0);
+
+    close(canFd);
+
+    return stats;
 }
 
-TEST(canIDConvertion, extendedIdRTR)
+static double multiFps(const MultiRxStats &st)
 {
-    uint32_t canIdConverted = 0;
-    mcba_usb_msg_can usb_msg;
-    struct can_frame cf;
+    std::chrono::duration<double> t = st.last - st.first;
 
-    for(uint32_t i = 1; i < 0x20000000; ++i)
-    {
-	cf.can_id = i | MCBA_CAN_RTR_MASK | MCBA_CAN_EXID_MASK;
+    return st.received > 1 && t.count() > 0 ? (st.received - 1) / t.count() : 0;
+}
 
-	usb_msg.sidl = MCBA_SET_E_SIDL(cf.can_id);
-	usb_msg.sidh = MCBA_SET_E_SIDH(cf.can_id);
-	usb_msg.eidl = MCBA_SET_EIDL(cf.can_id);
-	usb_msg.eidh = MCBA_SET_EIDH(cf.can_id);
-	usb_msg.dlc = MCBA_DLC_RTR_MASK;
+/* Per device and aggregate throughput, from the first to the last frame */
+static void printMultiStats(const char *name,
+                            const std::vector<std::string> &devs,
+                            const std::vector<MultiRxStats> &stats)
+{
+    MultiRxStats total = {0, 0, {}, {}};
 
-	canIdConverted = MCBA_CAN_GET_EID((&usb_msg));
+    for(size_t i = 0; i < devs.size(); ++i)
+    {
+        const MultiRxStats &st = stats[i];
 
-	if(MCBA_RX_IS_EXID((&usb_msg)))
-	    canIdConverted |= MCBA_CAN_EXID_MASK;
+        printf("%s %s: %u frames, %u out of order, %.1f fps\n", name,
+               devs[i].c_str(), st.received, st.outOfOrder, multiFps(st));
 
-	if(MCBA_RX_IS_RTR((&usb_msg)))
-	    canIdConverted |= MCBA_CAN_RTR_MASK;
+        if(!st.received)
+            continue;
 
-	EXPECT_EQ(cf.can_id, canIdConverted);
+        if(!total.received || st.first < total.first)
+            total.first = st.first;
+        if(!total.received || st.last > total.last)
+            total.last = st.last;
+        total.received += st.received;
+        total.outOfOrder += st.outOfOrder;
     }
+
+    printf("%s aggregate: %u frames, %.1f fps\n", name, total.received,
+           multiFps(total));
 }
 
+/***********************************************
+ *
+ *  can0 - Microchip CAN BUS Analyzer
+ *  can1 - Other SocketCAN
+ *
+ ***********************************************/
+
 TEST(can_id_rcv, sid)
 {
     const int testCnt = 0x7ff;
@@ -828,6 +907,89 @@ TEST(stress_rcv, 4on1)
     EXPECT_EQ((testCnt+1)*4+1, readRet.get());
 }
 
+TEST(stress_snd, batch)
+{
+    const int testCnt = 0x7ff;
+
+    std::future<int> readRet = std::async(&canReadThreadBatch, "can1", 0);
+    std::future<int> writeRet = std::async(&canWriteThreadBatch, "can0", testCnt, 0);
+
+    EXPECT_EQ(testCnt+1, writeRet.get());
+    EXPECT_EQ(testCnt+1, readRet.get());
+}
+
+TEST(stress_rcv, batch)
+{
+    const int testCnt = 0x7ff;
+
+    std::future<int> readRet = std::async(&canReadThreadBatch, "can0", 0);
+    std::future<int> writeRet = std::async(&canWriteThreadBatch, "can1", testCnt, 0);
+
+    EXPECT_EQ(testCnt+1, writeRet.get());
+    EXPECT_EQ(testCnt+1, readRet.get());
+}
+
+/* All MCBA_DEVICES send at once, can1 tells the streams apart by id */
+TEST(stress_multi, snd)
+{
+    const int testCnt = 0x7ff;
+    std::vector<std::string> devs = getMultiDevices();
+    std::vector<std::future<int>> writeRet;
+
+    std::future<std::vector<MultiRxStats>> readRet =
+        std::async(std::launch::async, &canReadThreadMulti, "can1",
+                   devs.size());
+
+    for(size_t i = 0; i < devs.size(); ++i)
+        writeRet.push_back(std::async(std::launch::async,
+                                      &canWriteThreadBatch, devs[i].c_str(),
+                                      testCnt,
+                                      CAN_EFF_FLAG | (i << MULTI_DEV_SHIFT)));
+
+    for(auto &ret : writeRet)
+        EXPECT_EQ(testCnt+1, ret.get());
+
+    std::vector<MultiRxStats> stats = readRet.get();
+
+    printMultiStats("snd", devs, stats);
+
+    for(const MultiRxStats &st : stats)
+    {
+        EXPECT_EQ((unsigned int)testCnt+1, st.received);
+        EXPECT_EQ(0u, st.outOfOrder);
+    }
+}
+
+/* can1 sends, all MCBA_DEVICES receive the same stream at once */
+TEST(stress_multi, rcv)
+{
+    const int testCnt = 0x7ff;
+    std::vector<std::string> devs = getMultiDevices();
+    std::vector<std::future<std::vector<MultiRxStats>>> readRet;
+    std::vector<MultiRxStats> stats;
+
+    for(const std::string &dev : devs)
+        readRet.push_back(std::async(std::launch::async,
+                                     &canReadThreadMulti, dev.c_str(), 1));
+
+    std::future<int> writeRet = std::async(std::launch::async,
+                                           &canWriteThreadBatch, "can1",
+                                           testCnt, CAN_EFF_FLAG);
+
+    EXPECT_EQ(testCnt+1, writeRet.get());
+
+    for(auto &ret : readRet)
+        stats.push_back(ret.get()[0]);
+
+    printMultiStats("rcv", devs, stats);
+
+    for(const MultiRxStats &st : stats)
+    {
+        EXPECT_EQ((unsigned int)testCnt+1, st.received);
+        EXPECT_EQ(0u, st.outOfOrder);
+    }
+}
+
 TEST(dlc_snd, dlc)
 {
     int dataSent = 0;
@@ -969,9 +1131,328 @@ TEST(Configuration, SpeedSettings)
     EXPECT_EQ(0, system("sudo ip link set can0 down"));
 }
 
+void setCtrlMode(const char *interface, const char *mode)
+{
+    char buff[150];
+
+    sprintf(buff, "sudo ip link set %s down && sudo ip link set %s type can bitrate 1000000 %s && sudo ip link set %s up && sleep 1",
+            interface, interface, mode, interface);
+    EXPECT_EQ(0, system(buff));
+}
+
+static void setTxDisable(const char *interface, char value)
+{
+    char buff[150];
+
+    sprintf(buff, "sudo ip link set %s down && echo %c | sudo tee /sys/class/net/%s/tx_disable > /dev/null && sudo ip link set %s up && sleep 1",
+            interface, value, interface, interface);
+    EXPECT_EQ(0, system(buff));
+}
+
+// The driver claims no listen-only, the controller would still ACK
+TEST(ctrlmode, listenOnly)
+{
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+    EXPECT_NE(0, system("sudo ip link set can0 type can listen-only on 2> /dev/null"));
+    EXPECT_EQ(0, system("sudo ip link set can0 up"));
+}
+
+// Nothing goes out, the frame is counted as dropped
+TEST(ctrlmode, txDisable)
+{
+    can_frame frame;
+
+    setTxDisable("can0", '1');
+
+    // writable only while down
+    EXPECT_NE(0, system("echo 0 | sudo tee /sys/class/net/can0/tx_disable 2> /dev/null"));
+
+    int rxFd = openCANSocket("can1");
+    int txFd = openCANSocket("can0");
+
+    EXPECT_EQ(CAN_MTU, writeCAN(txFd, 0x123, 2, 0xaa, 0x55));
+    EXPECT_EQ(0, readCAN(rxFd, &frame));
+
+    // frames from the bus are still received
+    EXPECT_EQ(CAN_MTU, writeCAN(rxFd, 0x124, 1, 0x11));
+    EXPECT_EQ(CAN_MTU, readCAN(txFd, &frame));
+    EXPECT_EQ(0x124, frame.can_id);
+
+    close(txFd);
+    close(rxFd);
+
+    setTxDisable("can0", '0');
+}
+
+// The frame comes back on can0 and never reaches the bus
+TEST(ctrlmode, loopback)
+{
+    can_frame frame;
+
+    setCtrlMode("can0", "loopback on");
+
+    int rxFd = openCANSocket("can1");
+    int txFd = openCANSocket("can0");
+    int lbFd = openCANSocket("can0");
+
+    EXPECT_EQ(CAN_MTU, writeCAN(txFd, 0x123, 2, 0xaa, 0x55));
+
+    EXPECT_EQ(0, readCAN(rxFd, &frame));
+
+    // looped back frame first, then the local echo
+    for(int i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(CAN_MTU, readCAN(lbFd, &frame));
+        EXPECT_EQ(0x123, frame.can_id);
+        EXPECT_EQ(2, frame.can_dlc);
+        EXPECT_EQ(0xaa, frame.data[0]);
+        EXPECT_EQ(0x55, frame.data[1]);
+    }
+
+    close(lbFd);
+    close(txFd);
+    close(rxFd);
+
+    setCtrlMode("can0", "loopback off");
+}
+
+// debugfs capture file of the first analyzer
+static std::string getCaptureFile()
+{
+    glob_t g;
+    std::string path;
+
+    if (!glob("/sys/kernel/debug/mcba_usb/*/capture", 0, NULL, &g))
+        path = g.gl_pathv[0];
+    globfree(&g);
+
+    return path;
+}
+
+// Raw records reach the ring in order, alongside SocketCAN delivery
+TEST(capture, ring)
+{
+    const int testCnt = 0x3ff;
+    const unsigned int cnt = testCnt + 1;
+    std::string path = getCaptureFile();
+
+    ASSERT_FALSE(path.empty());
+
+    configureCAN("can0", 1000000);
+    configureCAN("can1", 1000000);
+
+    int capFd = open(path.c_str(), O_RDWR);
+    ASSERT_LE(0, capFd);
+
+    // one reader at a time
+    EXPECT_GT(0, open(path.c_str(), O_RDWR));
+
+    mcba_cap_hdr *hdr = (mcba_cap_hdr *)mmap(NULL, sysconf(_SC_PAGESIZE),
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, capFd, 0);
+    ASSERT_NE(MAP_FAILED, hdr);
+    EXPECT_EQ(MCBA_CAP_MAGIC, hdr->magic);
+    EXPECT_EQ(MCBA_CAP_VERSION, hdr->version);
+    EXPECT_EQ(sizeof(mcba_cap_rec), hdr->rec_size);
+    EXPECT_GE(hdr->rec_cnt, cnt);
+
+    size_t len = hdr->data_offset + (size_t)hdr->rec_cnt * hdr->rec_size;
+    uint32_t mask = hdr->rec_cnt - 1;
+
+    munmap(hdr, sysconf(_SC_PAGESIZE));
+
+    u8 *mem = (u8 *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         capFd, 0);
+    ASSERT_NE(MAP_FAILED, mem);
+    hdr = (mcba_cap_hdr *)mem;
+    mcba_cap_rec *rec = (mcba_cap_rec *)(mem + hdr->data_offset);
+
+    std::future<int> readRet = std::async(std::launch::async,
+                                          &canReadThread, "can0", 0);
+    std::future<int> writeRet = std::async(std::launch::async,
+                                           &canWriteThread, "can1", testCnt, 0);
+
+    EXPECT_EQ(cnt, writeRet.get());
+    EXPECT_EQ(cnt, readRet.get());
+
+    uint64_t tail = hdr->tail;
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t prevTs = 0;
+
+    EXPECT_EQ(cnt, head - tail);
+    EXPECT_EQ(0u, hdr->dropped);
+
+    for (canid_t id = 0; tail < head; ++tail, ++id)
+    {
+        const mcba_cap_rec *r = &rec[tail & mask];
+
+        EXPECT_EQ(MBCA_CMD_RECEIVE_MESSAGE, r->msg[0]);
+        EXPECT_EQ(id, (canid_t)(r->msg[3] << 3 | r->msg[4] >> 5));
+        EXPECT_LE(prevTs, r->ts_ns);
+        prevTs = r->ts_ns;
+    }
+
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+
+    munmap(mem, len);
+    close(capFd);
+
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+    EXPECT_EQ(0, system("sudo ip link set can1 down"));
+}
+
+static unsigned long getBusLoad(const char *interface, const char *name)
+{
+    char buff[100];
+    unsigned long val = 0;
+
+    sprintf(buff, "/sys/class/net/%s/bus_load/%s", interface, name);
+
+    FILE *f = fopen(buff, "r");
+    EXPECT_NE(nullptr, f);
+    if (!f)
+        return 0;
+
+    EXPECT_EQ(1, fscanf(f, "%lu", &val));
+    fclose(f);
+
+    return val;
+}
+
+// Every received frame is accounted, rates follow within a second
+TEST(busLoad, rcv)
+{
+    const int testCnt = 0x7ff;
+
+    configureCAN("can0", 1000000);
+    configureCAN("can1", 1000000);
+
+    unsigned long frames = getBusLoad("can0", "frames");
+    unsigned long bits = getBusLoad("can0", "bits");
+
+    std::future<int> readRet = std::async(&canReadThread, "can0", 0);
+    std::future<int> writeRet = std::async(&canWriteThread, "can1", testCnt, 0);
+
+    EXPECT_EQ(testCnt+1, writeRet.get());
+    EXPECT_EQ(testCnt+1, readRet.get());
+
+    EXPECT_EQ(testCnt+1, getBusLoad("can0", "frames") - frames);
+
+    // 8 data bytes, SFF: 111 bits plus whatever stuffing they need
+    bits = getBusLoad("can0", "bits") - bits;
+    EXPECT_GE(bits, 111ul * (testCnt+1));
+    EXPECT_LE(bits, 135ul * (testCnt+1));
+
+    EXPECT_LT(0ul, getBusLoad("can0", "peak_frames_per_sec"));
+    EXPECT_LT(0ul, getBusLoad("can0", "load_avg_permille"));
+}
+
+// Coalesced, and after an idle period with URBs parked, no frame is lost
+TEST(Configuration, Coalesce)
+{
+    const int testCnt = 0x7ff;
+
+    configureCAN("can0", 1000000);
+    configureCAN("can1", 1000000);
+
+    EXPECT_EQ(0, system("sudo ethtool -C can0 rx-usecs 500 rx-frames 4 "
+                        "adaptive-rx on rx-usecs-low 2000"));
+
+    for (int i = 0; i < 2; ++i)
+    {
+        // long enough for the driver to call the bus idle
+        usleep(200000);
+
+        std::future<int> readRet = std::async(&canReadThread, "can0", 0);
+        std::future<int> writeRet = std::async(&canWriteThread, "can1",
+                                               testCnt, 0);
+
+        EXPECT_EQ(testCnt+1, writeRet.get());
+        EXPECT_EQ(testCnt+1, readRet.get());
+    }
+
+    EXPECT_EQ(0, system("sudo ethtool -C can0 rx-usecs 0 rx-frames 1 "
+                        "adaptive-rx off rx-usecs-low 1000"));
+
+    // rx-frames beyond the RX ring is refused
+    EXPECT_NE(0, system("sudo ethtool -C can0 rx-frames 65"));
+}
+
+// Same sweep as SpeedSettings, without taking the interface down
+TEST(Configuration, SpeedSweep)
+{
+    const int bitrateSet[] = {20000, 33333, 50000, 80000, 83333, 100000,
+                             125000, 150000, 175000, 200000, 225000, 250000,
+                            275000, 300000, 500000, 625000, 800000, 1000000};
+
+    const int bitrateGet[] = {20000, 33333, 50000, 80000, 83333, 100000,
+                             125000, 150375, 175438, 200000, 227272, 250000,
+                            277777, 303030, 500000, 625000, 800000, 1000000};
+    char buff[100];
+
+    configureCAN("can0", 1000000);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for(int i = 0; i < 18; ++i)
+    {
+        EXPECT_EQ(0, setBitrate("can0", bitrateSet[i]));
+        EXPECT_EQ(bitrateGet[i], getBitrate("can0"));
+    }
+
+    std::chrono::duration<double, std::milli> t =
+        std::chrono::steady_clock::now() - start;
+
+    printf("18 bitrates in %.1f ms\n", t.count());
+    EXPECT_LT(t.count(), 1000.0);
+
+    // netlink sees the retuned bittiming
+    sprintf(buff, "sudo ip -d link show can0 | grep %d > /dev/null", bitrateGet[17]);
+    EXPECT_EQ(0, system(buff));
+
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+}
+
+// Requests snap to the nearest firmware setting within 5%
+TEST(Configuration, SpeedNearest)
+{
+    EXPECT_EQ(0, setBitrate("can0", 148000));
+    EXPECT_EQ(150375, getBitrate("can0"));
+
+    EXPECT_EQ(0, setBitrate("can0", 1040000));
+    EXPECT_EQ(1000000, getBitrate("can0"));
+
+    EXPECT_NE(0, setBitrate("can0", 400000));
+    EXPECT_EQ(1000000, getBitrate("can0"));
+
+    EXPECT_NE(0, setBitrate("can0", 1100000));
+    EXPECT_NE(0, setBitrate("can0", 1000));
+}
+
+// Known from the query after probe, before the interface was ever up
+TEST(Configuration, FirmwareVersion)
+{
+    const char *files[] = {"usb_fw_version", "can_fw_version"};
+    char buff[100];
+
+    EXPECT_EQ(0, system("sudo ip link set can0 down"));
+
+    for(const char *file : files)
+    {
+        unsigned int major = 0, minor = 0;
+
+        sprintf(buff, "/sys/class/net/can0/%s", file);
+
+        FILE *f = fopen(buff, "r");
+        ASSERT_NE(nullptr, f);
+        EXPECT_EQ(2, fscanf(f, "%u.%u", &major, &minor));
+        EXPECT_NE(0u, major);
+        fclose(f);
+    }
+}
+
 TEST(Configuration, Termination)
 {
-    FILE *f = 0;
     char initValue = -1;
     char value = -1;
     const char *termPath = "/sys/class/net/can0/termination";